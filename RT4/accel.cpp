@@ -0,0 +1,115 @@
+#include "accel.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+/*************************************/
+/************ Accelerator ************/
+/*************************************/
+
+/** Virtual destructor so the structures can be deleted through the base */
+Accelerator::~Accelerator() {}
+
+/**
+ * Finds the closest hits of a packet of rays by tracing them one by one
+ * @param rays     The rays
+ * @param n        The number of rays
+ * @param out_hits The closest hit of each ray, with a NULL surface if none
+ */
+void Accelerator::closest_hits(const Ray *rays, int n, Hit *out_hits) {
+	for (int i=0; i!=n; i++)
+		closest_hit(rays[i], out_hits[i]);
+}
+
+
+/*************************************/
+/************ BruteForce *************/
+/*************************************/
+
+/**
+ * Keeps the list of surfaces. The surfaces are not copied, so they must
+ * outlive the structure.
+ * @param surfaces The surfaces of the scene
+ */
+void BruteForce::build(const std::vector<Surface*>& surfaces) {
+	prims = surfaces;
+	refit();
+}
+
+/**
+ * Only the box is updated, the surfaces are tested where they are
+ * @return false
+ */
+bool BruteForce::refit() {
+	box = AABB();
+	for (Surface *s : prims)
+		box.grow(s->get_bounds());
+	return false;
+}
+
+/**
+ * Tests every surface and keeps the closest one in front of the origin.
+ * The first surface in the scene wins ties.
+ * @param  ray     The ray to trace
+ * @param  out_hit The hit of the closest surface, t is INFINITY if none
+ * @return         The closest surface, or NULL if none is hit
+ */
+Surface* BruteForce::closest_hit(Ray ray, Hit& out_hit) {
+	out_hit = Hit();
+	Hit h;
+	for (Surface *surface : prims) {
+		float t = surface->hit(ray, h);
+		if (t > 0.0 && t < out_hit.t)
+			out_hit = h;
+	}
+	return out_hit.surface;
+}
+
+/**
+ * Occlusion query for shadow rays, see BVH::any_hit
+ * @param  ray       The shadow ray
+ * @param  t_max     The distance to the light source
+ * @param  ignore    The surface the ray starts from, never counted
+ * @param  out_alpha The sum of the alphas of the transparent occluders
+ * @param  out_count The number of transparent occluders
+ * @return           true if an opaque surface blocks the ray
+ */
+bool BruteForce::any_hit(Ray ray, float t_max, Surface *ignore, float& out_alpha, int& out_count) {
+	out_alpha = 0.0; out_count = 0;
+	for (Surface *s : prims) {
+		if (s == ignore)
+			continue;
+		Hit h;
+		float t = s->hit(ray, h);
+		if (t > 0.0 && t <= t_max) {
+			if (h.prim->mtl_color.alpha >= 1.0)
+				return true;
+			out_alpha += h.prim->mtl_color.alpha;
+			out_count++;
+		}
+	}
+	return false;
+}
+
+/**
+ * The box enclosing all surfaces
+ * @return The bounding box
+ */
+AABB BruteForce::get_bounds() {
+	return box;
+}
+
+/**
+ * The size of the surface list
+ * @return The size in bytes
+ */
+size_t BruteForce::memory() {
+	return prims.size()*sizeof(Surface*);
+}
+
+/**
+ * Prints statistics about the structure
+ */
+void BruteForce::print() {
+	printf("BruteForce:= surfaces: %zu\n", prims.size());
+}
@@ -0,0 +1,64 @@
+#ifndef _ACCEL_HPP
+#define _ACCEL_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "geometry.hpp"
+#include "surfaces.hpp"
+
+/**
+ * The acceleration structures that can be used for the scene:
+ * ACCEL_BVH is the bounding volume hierarchy, ACCEL_GRID a uniform grid,
+ * ACCEL_TWO_LEVEL_GRID a coarse grid with finer grids in its crowded cells
+ * and ACCEL_BRUTE_FORCE tests every surface.
+ */
+enum AccelType { ACCEL_BVH, ACCEL_GRID, ACCEL_TWO_LEVEL_GRID, ACCEL_BRUTE_FORCE };
+
+/**
+ * Accelerator is a base class for the structures that find the surfaces
+ * hit by a ray. All of them give the same answers as testing every surface.
+ * 	build:	builds the structure over the given surfaces
+ * 	refit:	updates the structure after the surfaces moved, returns true if
+ * 		it had to be built again
+ * 	closest_hit:	finds the closest surface hit by the ray, like trace_ray,
+ * 		and its Hit record
+ * 	closest_hits:	closest_hit for a packet of coherent rays, like the primary
+ * 		rays of a screen tile. Structures that can trace them together
+ * 		override it, the others trace them one by one
+ * 	any_hit:	occlusion query for shadow rays
+ * 	get_bounds:	the box enclosing the surfaces
+ * 	memory:	the number of bytes used by the structure
+ * 	print:	prints statistics about the structure
+ */
+class Accelerator {
+public:
+	virtual ~Accelerator();
+	virtual void build(const std::vector<Surface*>& surfaces) = 0;
+	virtual bool refit() = 0;
+	virtual Surface* closest_hit(Ray ray, Hit& out_hit) = 0;
+	virtual void closest_hits(const Ray *rays, int n, Hit *out_hits);
+	virtual bool any_hit(Ray ray, float t_max, Surface *ignore, float& out_alpha, int& out_count) = 0;
+	virtual AABB get_bounds() = 0;
+	virtual size_t memory() = 0;
+	virtual void print() = 0;
+};
+
+/**
+ * BruteForce is derived from Accelerator. It tests the ray against every
+ * surface, which is what trace_ray used to do.
+ */
+class BruteForce : public Accelerator {
+	std::vector<Surface*> prims;
+	AABB box;
+public:
+	void build(const std::vector<Surface*>& surfaces);
+	bool refit();
+	Surface* closest_hit(Ray ray, Hit& out_hit);
+	bool any_hit(Ray ray, float t_max, Surface *ignore, float& out_alpha, int& out_count);
+	AABB get_bounds();
+	size_t memory();
+	void print();
+};
+
+#endif
@@ -28,14 +28,13 @@ invalid_vector::~invalid_vector() throw() {}
 /*****************************************/
 
 invalid_file::invalid_file(std::string name) {
-	file_name = name;
+	msg = std::string("Could not find file");
+	if (name.length() != 0)
+		msg += std::string(" with name \'") + name + std::string("\'");
+	msg += ".";
 }
 
 const char* invalid_file::what() const throw() {
-	std::string msg = std::string("Could not find file");
-	if (file_name.length() != 0)
-		msg += std::string(" with name \'") + file_name + std::string("\'");
-	msg += ".";
 	return msg.c_str();
 }
 
@@ -87,4 +86,44 @@ const char* invalid_color::what() const throw() {
 
 const char* invalid_constant::what() const throw() {
 	return "The constant is invalid: 0<=k<=1";
-}
\ No newline at end of file
+}
+
+/******************************************/
+/************ invalid_option **************/
+/******************************************/
+
+invalid_option::invalid_option(std::string option) {
+	msg = std::string("Invalid command line option \'") + option + std::string("\'.");
+}
+
+const char* invalid_option::what() const throw() {
+	return msg.c_str();
+}
+
+invalid_option::~invalid_option() throw() {}
+/******************************************/
+/************** farm_error ****************/
+/******************************************/
+
+farm_error::farm_error(std::string msg) {
+	this->msg = std::string("Render farm: ") + msg;
+}
+
+const char* farm_error::what() const throw() {
+	return msg.c_str();
+}
+
+farm_error::~farm_error() throw() {}
+/******************************************/
+/*********** checkpoint_error *************/
+/******************************************/
+
+checkpoint_error::checkpoint_error(std::string msg) {
+	this->msg = std::string("Checkpoint: ") + msg;
+}
+
+const char* checkpoint_error::what() const throw() {
+	return msg.c_str();
+}
+
+checkpoint_error::~checkpoint_error() throw() {}
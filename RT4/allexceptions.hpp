@@ -14,7 +14,7 @@ public:
 
 
 class invalid_file : public std::exception {
-	std::string file_name;
+	std::string msg;
 public:
 	invalid_file(std::string file_name=std::string(""));
 	const char* what() const throw();
@@ -49,4 +49,27 @@ public:
 class invalid_constant : public std::exception {
 public:
 	const char* what() const throw();
-};
\ No newline at end of file
+};
+
+class invalid_option : public std::exception {
+	std::string msg;
+public:
+	invalid_option(std::string option);
+	const char* what() const throw();
+	~invalid_option() throw();
+};
+class farm_error : public std::exception {
+	std::string msg;
+public:
+	farm_error(std::string msg);
+	const char* what() const throw();
+	~farm_error() throw();
+};
+
+class checkpoint_error : public std::exception {
+	std::string msg;
+public:
+	checkpoint_error(std::string msg);
+	const char* what() const throw();
+	~checkpoint_error() throw();
+};
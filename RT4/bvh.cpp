@@ -0,0 +1,1454 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SAH_TRAVERSAL 1.0	// cost of visiting an inner node
+#define SAH_INTERSECT 2.0	// cost of a surface intersection test
+#define SAH_BLOCK 4.0		// cost of testing a TriBlock, up to TRI_BLOCK triangles at once
+#define BVH_MAX_LEAF 8		// leaves larger than this are always split
+#define BVH_MAX_DEPTH 64	// below this depth the builder splits at the median
+#define BVH_STACK 256
+#define PACKET_MAX 256		// most rays traced together, a 16x16 tile
+#define BVH_BOX_EPS 1e-4	// padding so flat boxes are not missed by rounding
+#define BINNED_BINS 32		// centroid bins per axis for the binned builder
+#define BINNED_PARALLEL_MIN 4096	// smallest node that is split across threads
+#define REFIT_TASKS 4			// subtrees per thread when refitting
+#define REFIT_REBUILD_RATIO 1.5	// rebuild once refitting made the tree this much costlier
+
+static_assert(BVH_MAX_LEAF <= TRI_BLOCK, "the triangles of a leaf must fit a block");
+
+/**
+ * Per-surface data used while building: its box, the box centroid, the
+ * surface, its position in the scene list and 1 if it is a triangle.
+ */
+struct BVHPrim {
+	AABB box;
+	Vec3 centroid;
+	Surface *surface;
+	int id;
+	int tri;
+};
+
+/**
+ * The SAH cost of the surface tests of a leaf. Its triangles are tested
+ * TRI_BLOCK at a time, the other surfaces one by one.
+ * @param  n    The number of surfaces
+ * @param  tris How many of them are triangles
+ * @return      The cost
+ */
+static inline float leaf_cost(int n, int tris) {
+	return SAH_INTERSECT*(n - tris) + SAH_BLOCK*((tris + TRI_BLOCK-1)/TRI_BLOCK);
+}
+
+/**
+ * The position of a surface in its leaf: triangles first, then spheres,
+ * ellipsoids and the other surfaces
+ * @param  s The surface
+ * @return   0 to 3
+ */
+static inline int leaf_rank(const Surface *s) {
+	return s->type==3? 0: (s->type==1? 1: (s->type==2? 2: 3));
+}
+
+/** Get the axis component of a vector, 0 is x, 1 is y, 2 is z. */
+static inline float axis_of(const Vec3& v, int axis) {
+	return axis==0? v.x: (axis==1? v.y: v.z);
+}
+
+/**
+ * Per-ray data for traversal: origin, inverse direction and the sign of
+ * the direction on each axis.
+ */
+struct RayData {
+	float org[3], inv_dir[3];
+	int neg[3];
+	RayData(const Ray& ray) {
+		org[0] = ray.org.x; org[1] = ray.org.y; org[2] = ray.org.z;
+		inv_dir[0] = 1.0f/ray.dir.x; inv_dir[1] = 1.0f/ray.dir.y; inv_dir[2] = 1.0f/ray.dir.z;
+		/* use the inverse so that -0.0 counts as negative */
+		neg[0] = inv_dir[0] < 0.0; neg[1] = inv_dir[1] < 0.0; neg[2] = inv_dir[2] < 0.0;
+	}
+};
+
+/**
+ * Slab test of a ray against four boxes over the interval [0, t_max]. The
+ * near and far planes are picked from the signs of the direction, so empty
+ * slots (lo > hi) miss for finite rays. NaNs from 0*inf are dropped by
+ * keeping the running value, which means a ray with a NaN direction hits
+ * every slot; callers skip the empty ones.
+ * @param  lo    The low corners of the boxes, one array of 4 per axis
+ * @param  hi    The high corners of the boxes
+ * @param  rd    The ray data
+ * @param  t_max The far end of the interval
+ * @param  out_t The entry distance into each box
+ * @return       A bit mask of the boxes that are hit
+ */
+static inline int hit_boxes(const float *lo[3], const float *hi[3], const RayData& rd, float t_max, float out_t[4]) {
+#ifdef __SSE__
+	__m128 t_near = _mm_setzero_ps(), t_far = _mm_set1_ps(t_max);
+	for (int axis=0; axis!=3; axis++) {
+		__m128 org = _mm_set1_ps(rd.org[axis]), inv = _mm_set1_ps(rd.inv_dir[axis]);
+		__m128 near = _mm_loadu_ps(rd.neg[axis]? hi[axis]: lo[axis]);
+		__m128 far = _mm_loadu_ps(rd.neg[axis]? lo[axis]: hi[axis]);
+		/* MAXPS/MINPS return the second operand when the first is NaN */
+		t_near = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near, org), inv), t_near);
+		t_far = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far, org), inv), t_far);
+	}
+	_mm_storeu_ps(out_t, t_near);
+	return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+	int mask = 0;
+	for (int i=0; i!=4; i++) {
+		float t_near = 0.0, t_far = t_max;
+		for (int axis=0; axis!=3; axis++) {
+			float near = rd.neg[axis]? hi[axis][i]: lo[axis][i];
+			float far = rd.neg[axis]? lo[axis][i]: hi[axis][i];
+			float t0 = (near - rd.org[axis])*rd.inv_dir[axis], t1 = (far - rd.org[axis])*rd.inv_dir[axis];
+			t_near = t0 > t_near? t0: t_near;
+			t_far = t1 < t_far? t1: t_far;
+		}
+		out_t[i] = t_near;
+		mask |= (t_near <= t_far) << i;
+	}
+	return mask;
+#endif
+}
+
+/**
+ * Slab test of a ray against the four child boxes of a wide node
+ * @param  node  The wide node
+ * @param  rd    The ray data
+ * @param  t_max The far end of the interval
+ * @param  out_t The entry distance into each child box
+ * @return       A bit mask of the children that are hit
+ */
+static inline int hit_children(const BVH4Node& node, const RayData& rd, float t_max, float out_t[4]) {
+	const float *lo[3] = {node.lo_x, node.lo_y, node.lo_z};
+	const float *hi[3] = {node.hi_x, node.hi_y, node.hi_z};
+	return hit_boxes(lo, hi, rd, t_max, out_t);
+}
+
+/**
+ * 2^exp for exp in [-126, 127], made from the bits of the float. This is
+ * called three times for every quantized node visited, which is where a
+ * call to ldexpf shows up.
+ * @param  exp The exponent
+ * @return     2^exp
+ */
+static inline float exp2_int(int exp) {
+	unsigned bits = (unsigned) (exp + 127) << 23;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+#ifdef __SSE2__
+/**
+ * Decodes four quantized coordinates: origin + q*scale
+ * @param  q      The quantized values
+ * @param  origin The origin of the grid
+ * @param  scale  The grid step
+ * @return        The coordinates
+ */
+static inline __m128 dequantize(const unsigned char q[4], __m128 origin, __m128 scale) {
+	int packed;
+	memcpy(&packed, q, sizeof(packed));
+	__m128i zero = _mm_setzero_si128();
+	__m128i ints = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+	return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(ints), scale));
+}
+#endif
+
+/**
+ * Decodes the child boxes of a quantized node into floats
+ * @param node The quantized wide node
+ * @param lo   The low corners of the boxes, one array of 4 per axis
+ * @param hi   The high corners of the boxes
+ */
+static inline void decode_boxes(const QBVH4Node& node, float lo[3][4], float hi[3][4]) {
+	const unsigned char *qlo[3] = {node.lo_x, node.lo_y, node.lo_z};
+	const unsigned char *qhi[3] = {node.hi_x, node.hi_y, node.hi_z};
+	for (int axis=0; axis!=3; axis++) {
+		float scale = exp2_int(node.exp[axis]);
+		for (int i=0; i!=4; i++) {
+			lo[axis][i] = node.origin[axis] + qlo[axis][i]*scale;
+			hi[axis][i] = node.origin[axis] + qhi[axis][i]*scale;
+		}
+	}
+}
+
+/**
+ * Slab test of a ray against the four child boxes of a quantized node.
+ * The boxes are decoded in registers, the test is that of hit_boxes.
+ * @param  node  The quantized wide node
+ * @param  rd    The ray data
+ * @param  t_max The far end of the interval
+ * @param  out_t The entry distance into each child box
+ * @return       A bit mask of the children that are hit
+ */
+static inline int hit_children(const QBVH4Node& node, const RayData& rd, float t_max, float out_t[4]) {
+#ifdef __SSE2__
+	const unsigned char *qlo[3] = {node.lo_x, node.lo_y, node.lo_z};
+	const unsigned char *qhi[3] = {node.hi_x, node.hi_y, node.hi_z};
+	__m128 t_near = _mm_setzero_ps(), t_far = _mm_set1_ps(t_max);
+	for (int axis=0; axis!=3; axis++) {
+		__m128 origin = _mm_set1_ps(node.origin[axis]), scale = _mm_set1_ps(exp2_int(node.exp[axis]));
+		__m128 org = _mm_set1_ps(rd.org[axis]), inv = _mm_set1_ps(rd.inv_dir[axis]);
+		__m128 near = dequantize(rd.neg[axis]? qhi[axis]: qlo[axis], origin, scale);
+		__m128 far = dequantize(rd.neg[axis]? qlo[axis]: qhi[axis], origin, scale);
+		t_near = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near, org), inv), t_near);
+		t_far = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far, org), inv), t_far);
+	}
+	_mm_storeu_ps(out_t, t_near);
+	return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+	float lo_xyz[3][4], hi_xyz[3][4];
+	decode_boxes(node, lo_xyz, hi_xyz);
+	const float *lo[3] = {lo_xyz[0], lo_xyz[1], lo_xyz[2]};
+	const float *hi[3] = {hi_xyz[0], hi_xyz[1], hi_xyz[2]};
+	return hit_boxes(lo, hi, rd, t_max, out_t);
+#endif
+}
+
+/**
+ * Bounds of a packet of rays for the interval test: the range of the
+ * origins and of the inverse directions on each axis. The test only works
+ * if all rays point the same way on every axis, as the primary rays of a
+ * tile or the sorted rays of a RayQueue batch do, otherwise usable is false.
+ */
+struct PacketData {
+	bool usable;
+	float org_lo[3], org_hi[3], inv_lo[3], inv_hi[3];
+	int neg[3];
+	PacketData(const RayData *rd, int n) : usable(true) {
+		for (int axis=0; axis!=3; axis++) {
+			org_lo[axis] = org_hi[axis] = rd[0].org[axis];
+			inv_lo[axis] = inv_hi[axis] = rd[0].inv_dir[axis];
+			neg[axis] = rd[0].neg[axis];
+		}
+		for (int i=1; i!=n; i++)
+			for (int axis=0; axis!=3; axis++) {
+				if (rd[i].neg[axis] != neg[axis])
+					usable = false;
+				org_lo[axis] = std::min(org_lo[axis], rd[i].org[axis]);
+				org_hi[axis] = std::max(org_hi[axis], rd[i].org[axis]);
+				inv_lo[axis] = std::min(inv_lo[axis], rd[i].inv_dir[axis]);
+				inv_hi[axis] = std::max(inv_hi[axis], rd[i].inv_dir[axis]);
+			}
+	}
+};
+
+/**
+ * Interval test of a whole packet against four boxes over [0, t_max]. On
+ * each axis the distance to a plane, (plane - org)*inv, is bounded by its
+ * values at the corners of the ranges of origins and inverse directions;
+ * if the latest possible entry is after the earliest possible exit, no ray
+ * of the packet hits the box. A box that passes may still be missed by
+ * every ray. NaNs are dropped as in hit_boxes, which only loosens the
+ * bounds.
+ * @param  lo    The low corners of the boxes, one array of 4 per axis
+ * @param  hi    The high corners of the boxes
+ * @param  pd    The packet bounds, usable
+ * @param  t_max The largest t any ray of the packet still looks at
+ * @return       A bit mask of the boxes that may be hit
+ */
+static inline int hit_boxes_packet(const float *lo[3], const float *hi[3], const PacketData& pd, float t_max) {
+#ifdef __SSE__
+	__m128 t_near = _mm_setzero_ps(), t_far = _mm_set1_ps(t_max);
+	for (int axis=0; axis!=3; axis++) {
+		__m128 org_lo = _mm_set1_ps(pd.org_lo[axis]), org_hi = _mm_set1_ps(pd.org_hi[axis]);
+		__m128 inv_lo = _mm_set1_ps(pd.inv_lo[axis]), inv_hi = _mm_set1_ps(pd.inv_hi[axis]);
+		__m128 near = _mm_loadu_ps(pd.neg[axis]? hi[axis]: lo[axis]);
+		__m128 far = _mm_loadu_ps(pd.neg[axis]? lo[axis]: hi[axis]);
+		__m128 near_a = _mm_sub_ps(near, org_lo), near_b = _mm_sub_ps(near, org_hi);
+		__m128 far_a = _mm_sub_ps(far, org_lo), far_b = _mm_sub_ps(far, org_hi);
+		__m128 near_min = _mm_min_ps(_mm_min_ps(_mm_mul_ps(near_a, inv_lo), _mm_mul_ps(near_a, inv_hi)),
+																 _mm_min_ps(_mm_mul_ps(near_b, inv_lo), _mm_mul_ps(near_b, inv_hi)));
+		__m128 far_max = _mm_max_ps(_mm_max_ps(_mm_mul_ps(far_a, inv_lo), _mm_mul_ps(far_a, inv_hi)),
+																_mm_max_ps(_mm_mul_ps(far_b, inv_lo), _mm_mul_ps(far_b, inv_hi)));
+		t_near = _mm_max_ps(near_min, t_near);
+		t_far = _mm_min_ps(far_max, t_far);
+	}
+	return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+	int mask = 0;
+	for (int i=0; i!=4; i++) {
+		float t_near = 0.0, t_far = t_max;
+		for (int axis=0; axis!=3; axis++) {
+			float near = pd.neg[axis]? hi[axis][i]: lo[axis][i];
+			float far = pd.neg[axis]? lo[axis][i]: hi[axis][i];
+			float t0 = INFINITY, t1 = -INFINITY;
+			for (float org : {pd.org_lo[axis], pd.org_hi[axis]})
+				for (float inv : {pd.inv_lo[axis], pd.inv_hi[axis]}) {
+					t0 = std::min(t0, (near - org)*inv);
+					t1 = std::max(t1, (far - org)*inv);
+				}
+			t_near = t0 > t_near? t0: t_near;
+			t_far = t1 < t_far? t1: t_far;
+		}
+		mask |= (t_near <= t_far) << i;
+	}
+	return mask;
+#endif
+}
+
+/**
+ * Interval test of a packet against the four child boxes of a wide node
+ * @param  node  The wide node
+ * @param  pd    The packet bounds
+ * @param  t_max The largest t any ray of the packet still looks at
+ * @return       A bit mask of the children that may be hit
+ */
+static inline int hit_children_packet(const BVH4Node& node, const PacketData& pd, float t_max) {
+	const float *lo[3] = {node.lo_x, node.lo_y, node.lo_z};
+	const float *hi[3] = {node.hi_x, node.hi_y, node.hi_z};
+	return hit_boxes_packet(lo, hi, pd, t_max);
+}
+
+/**
+ * Interval test of a packet against the four child boxes of a quantized
+ * wide node. The boxes are decoded once for the whole packet.
+ * @param  node  The quantized wide node
+ * @param  pd    The packet bounds
+ * @param  t_max The largest t any ray of the packet still looks at
+ * @return       A bit mask of the children that may be hit
+ */
+static inline int hit_children_packet(const QBVH4Node& node, const PacketData& pd, float t_max) {
+	float lo_xyz[3][4], hi_xyz[3][4];
+	decode_boxes(node, lo_xyz, hi_xyz);
+	const float *lo[3] = {lo_xyz[0], lo_xyz[1], lo_xyz[2]};
+	const float *hi[3] = {hi_xyz[0], hi_xyz[1], hi_xyz[2]};
+	return hit_boxes_packet(lo, hi, pd, t_max);
+}
+
+/**
+ * The order in which to visit the children of a wide node, front to back
+ * along the ray. Children 0,1 and 2,3 are the pairs under the top split,
+ * so the signs of the direction on the three split axes decide the order.
+ * @param node  The wide node, BVH4Node or QBVH4Node
+ * @param rd    The ray data
+ * @param order The child slots, nearest first
+ */
+template <class Node>
+static inline void child_order(const Node& node, const RayData& rd, int order[4]) {
+	int first = rd.neg[node.axis[0]];
+	for (int k=0; k!=2; k++) {
+		int pair = k==0? first: 1-first;
+		int near = rd.neg[node.axis[1+pair]];
+		order[2*k] = 2*pair + near;
+		order[2*k+1] = 2*pair + 1-near;
+	}
+}
+
+/**
+ * The box of a surface, padded by BVH_BOX_EPS
+ * @param  s The surface
+ * @return   The padded box
+ */
+static inline AABB padded_bounds(Surface *s) {
+	Vec3 pad(BVH_BOX_EPS, BVH_BOX_EPS, BVH_BOX_EPS);
+	AABB box = s->get_bounds();
+	return AABB(box.lo - pad, box.hi + pad);
+}
+
+/**
+ * Quantizes four boxes to 8 bits on a grid over the box around them. The
+ * grid step on each axis is the smallest power of two for which 255 steps
+ * cover the box, so q*step is exact and decoding only rounds at the add.
+ * The values are rounded outwards and then checked against the decoded
+ * value, which is what traversal sees; if rounding still cuts a box the
+ * step is doubled.
+ * @param q   The node to store the grid and quantized boxes in
+ * @param box The boxes, empty ones (lo > hi) are stored as empty
+ */
+static void quantize_boxes(QBVH4Node& q, const AABB box[4]) {
+	AABB parent;
+	for (int i=0; i!=4; i++)
+		if (box[i].lo.x <= box[i].hi.x)
+			parent.grow(box[i]);
+
+	unsigned char *qlo[3] = {q.lo_x, q.lo_y, q.lo_z};
+	unsigned char *qhi[3] = {q.hi_x, q.hi_y, q.hi_z};
+	for (int axis=0; axis!=3; axis++) {
+		float origin = axis_of(parent.lo, axis), ext = axis_of(parent.hi, axis) - origin;
+		int exp = ext > 0.0? std::max(-126, (int) ceilf(log2f(ext/255.0f))): -126;
+		for (bool fits=false; !fits; exp++) {
+			float scale = exp2_int(exp);
+			fits = true;
+			for (int i=0; i!=4; i++) {
+				float lo = axis_of(box[i].lo, axis), hi = axis_of(box[i].hi, axis);
+				if (lo > hi || parent.lo.x > parent.hi.x) {
+					qlo[axis][i] = 255; qhi[axis][i] = 0;
+					continue;
+				}
+				int l = std::min(std::max((int) floorf((lo - origin)/scale), 0), 255);
+				int h = std::min(std::max((int) ceilf((hi - origin)/scale), 0), 255);
+				while (l > 0 && origin + l*scale > lo)
+					l--;
+				while (h < 255 && origin + h*scale < hi)
+					h++;
+				fits = fits && origin + l*scale <= lo && origin + h*scale >= hi;
+				qlo[axis][i] = l; qhi[axis][i] = h;
+			}
+			q.origin[axis] = origin;
+			q.exp[axis] = exp;
+		}
+	}
+}
+
+/**
+ * Stores a box in a slot of a wide node
+ * @param w   The wide node
+ * @param i   The slot
+ * @param box The box
+ */
+static inline void set_slot(BVH4Node& w, int i, const AABB& box) {
+	w.lo_x[i] = box.lo.x; w.lo_y[i] = box.lo.y; w.lo_z[i] = box.lo.z;
+	w.hi_x[i] = box.hi.x; w.hi_y[i] = box.hi.y; w.hi_z[i] = box.hi.z;
+}
+
+/**
+ * @constructor
+ * @param builder The builder used by build
+ * @param layout  The node layout used by build
+ */
+BVH::BVH(BVHBuilder builder, BVHLayout layout) {
+	depth = 0;
+	this->builder = builder;
+	this->layout = layout;
+	build_cost = 0.0;
+}
+
+/**
+ * Runs f(k, begin, end) over [start, end) split into one chunk per thread,
+ * k being the number of the chunk.
+ * With a single thread f is called directly.
+ * @param start   The first index
+ * @param end     One past the last index
+ * @param threads The number of threads to use
+ * @param f       The work for one chunk
+ */
+static void parallel_chunks(int start, int end, int threads, const std::function<void(int, int, int)>& f) {
+	if (threads <= 1 || end-start < 2*threads) {
+		f(0, start, end);
+		return;
+	}
+	std::vector<std::thread> workers;
+	int chunk = (end-start + threads-1)/threads;
+	for (int k=0; k!=threads; k++) {
+		int b = std::min(end, start+k*chunk), e = std::min(end, b+chunk);
+		workers.push_back(std::thread(f, k, b, e));
+	}
+	for (std::thread& w : workers)
+		w.join();
+}
+
+/**
+ * Builds the tree over the surfaces with the builder and layout of the
+ * constructor or of the last build
+ * @param surfaces The surfaces of the scene
+ */
+void BVH::build(const std::vector<Surface*>& surfaces) {
+	build(surfaces, builder, layout);
+}
+
+/**
+ * Builds the tree over the surfaces. The surfaces are not copied, so they
+ * must outlive the tree.
+ * @param surfaces The surfaces of the scene
+ * @param builder  BVH_SAH for the full-sweep SAH builder, BVH_BINNED for
+ *                 the faster multi-threaded binned builder
+ * @param layout   BVH_FLOAT or BVH_QUANTIZED wide nodes
+ */
+void BVH::build(const std::vector<Surface*>& surfaces, BVHBuilder builder, BVHLayout layout) {
+	nodes.clear(); wide.clear(); qwide.clear(); wide_slots.clear(); prims.clear(); prim_ids.clear();
+	blocks.clear(); spheres.clear(); ellipsoids.clear(); leaves.clear();
+	depth = 0;
+	build_cost = 0.0;
+	this->builder = builder;
+	this->layout = layout;
+	if (surfaces.empty())
+		return;
+
+	int threads = builder==BVH_BINNED? std::max(1u, std::thread::hardware_concurrency()): 1;
+	std::vector<BVHPrim> bp(surfaces.size());
+	parallel_chunks(0, bp.size(), threads, [&](int /*k*/, int b, int e) {
+		for (int i=b; i!=e; i++) {
+			bp[i].box = padded_bounds(surfaces[i]);
+			bp[i].centroid = bp[i].box.centroid();
+			bp[i].surface = surfaces[i];
+			bp[i].id = i;
+			bp[i].tri = surfaces[i]->type == 3;
+		}
+	});
+
+	nodes.reserve(2*surfaces.size());
+	if (builder == BVH_BINNED) {
+		std::vector<BVHPrim> tmp(bp.size());
+		build_binned(bp, tmp, 0, bp.size(), 1, threads, nodes, depth);
+	}
+	else
+		build_recursive(bp, 0, bp.size(), 1);
+
+	wide.reserve(nodes.size()/2 + 1);
+	wide_slots.reserve(2*nodes.size() + 4);
+	collapse(0);
+	if (layout == BVH_QUANTIZED) {
+		qwide.resize(wide.size());
+		for (size_t w=0; w!=wide.size(); w++) {
+			for (int i=0; i!=4; i++) {
+				qwide[w].child[i] = wide[w].child[i];
+				qwide[w].count[i] = wide[w].count[i];
+				qwide[w].axis[i%3] = wide[w].axis[i%3];
+			}
+			quantize(w);
+		}
+		std::vector<BVH4Node>().swap(wide);
+	}
+
+	for (const BVHNode& n : nodes)
+		if (n.count > 0)
+			std::stable_sort(bp.begin()+n.offset, bp.begin()+n.offset+n.count, [](const BVHPrim& a, const BVHPrim& b) {
+				return leaf_rank(a.surface) < leaf_rank(b.surface);
+			});
+	prims.reserve(bp.size()); prim_ids.reserve(bp.size());
+	for (BVHPrim& p : bp) {
+		prims.push_back(p.surface);
+		prim_ids.push_back(p.id);
+	}
+	fill_leaves();
+	build_cost = sah_cost();
+}
+
+/**
+ * Updates the boxes of the tree after the surfaces have moved, keeping its
+ * topology. The nodes are refit bottom-up: the tree is cut into subtrees
+ * which are refit on all cores, then the few nodes above them, then the
+ * wide nodes are copied from the binary ones.
+ * Moving surfaces make the boxes overlap more. When the SAH cost of the
+ * refit tree is REFIT_REBUILD_RATIO times what it was after the build, the
+ * tree is rebuilt from scratch instead.
+ * @return true if the tree was rebuilt
+ */
+bool BVH::refit() {
+	if (nodes.empty())
+		return false;
+
+	/* cut the tree into subtrees, breadth first from the root */
+	int threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<int> top, roots(1, 0);
+	while (roots.size() < (size_t) threads*REFIT_TASKS) {
+		std::vector<int> next;
+		for (int r : roots)
+			if (nodes[r].count > 0)
+				next.push_back(r);
+			else {
+				top.push_back(r);
+				next.push_back(r+1);
+				next.push_back(nodes[r].offset);
+			}
+		if (next.size() == roots.size())
+			break;
+		roots.swap(next);
+	}
+
+	/* a subtree is stored contiguously and ends after its rightmost leaf */
+	parallel_chunks(0, roots.size(), threads, [&](int /*k*/, int b, int e) {
+		for (int i=b; i!=e; i++) {
+			int last = roots[i];
+			while (nodes[last].count == 0)
+				last = nodes[last].offset;
+			refit_range(roots[i], last+1);
+		}
+	});
+	/* parents come before their children */
+	std::sort(top.begin(), top.end());
+	for (int i=top.size()-1; i>=0; i--) {
+		BVHNode& n = nodes[top[i]];
+		n.box = nodes[top[i]+1].box;
+		n.box.grow(nodes[n.offset].box);
+	}
+
+	parallel_chunks(0, wide_slots.size()/4, threads, [&](int /*k*/, int b, int e) {
+		for (int w=b; w!=e; w++) {
+			if (layout == BVH_QUANTIZED) {
+				quantize(w);
+				continue;
+			}
+			for (int i=0; i!=4; i++)
+				if (wide_slots[4*w+i] != -1)
+					set_slot(wide[w], i, nodes[wide_slots[4*w+i]].box);
+		}
+	});
+
+	if (sah_cost() <= REFIT_REBUILD_RATIO*build_cost) {
+		fill_leaves();
+		return false;
+	}
+
+	std::vector<Surface*> surfaces(prims.size());
+	for (size_t i=0; i!=prims.size(); i++)
+		surfaces[prim_ids[i]] = prims[i];
+	build(surfaces, builder, layout);
+	return true;
+}
+
+/**
+ * Quantizes the boxes of the slots of wide node w from the binary nodes
+ * behind them
+ * @param w The wide node
+ */
+void BVH::quantize(int w) {
+	AABB box[4]; // empty unless the slot is used
+	for (int i=0; i!=4; i++)
+		if (wide_slots[4*w+i] != -1)
+			box[i] = nodes[wide_slots[4*w+i]].box;
+	quantize_boxes(qwide[w], box);
+}
+
+/**
+ * Refits the nodes [start, end), which must be a whole subtree, from the
+ * last to the first so that children are done before their parents.
+ * @param start The root of the subtree
+ * @param end   One past the last node of the subtree
+ */
+void BVH::refit_range(int start, int end) {
+	for (int i=end-1; i>=start; i--) {
+		BVHNode& n = nodes[i];
+		if (n.count > 0) {
+			n.box = AABB();
+			for (int j=n.offset; j!=n.offset+n.count; j++)
+				n.box.grow(padded_bounds(prims[j]));
+		}
+		else {
+			n.box = nodes[i+1].box;
+			n.box.grow(nodes[n.offset].box);
+		}
+	}
+}
+
+/**
+ * Copies the geometry of every leaf into the arrays of its types, after a
+ * build or after the surfaces moved.
+ */
+void BVH::fill_leaves() {
+	blocks.clear(); spheres.clear(); ellipsoids.clear();
+	leaves.assign(prims.size(), BVHLeaf());
+	for (const BVHNode& n : nodes) {
+		if (n.count == 0)
+			continue;
+		BVHLeaf& leaf = leaves[n.offset];
+		leaf.block = -1;
+		leaf.spheres = spheres.size();
+		leaf.ellipsoids = ellipsoids.size();
+		leaf.n_tris = leaf.n_spheres = leaf.n_ellipsoids = 0;
+		int i = n.offset, end = n.offset+n.count;
+		for (; i!=end && prims[i]->type == 3; i++)
+			leaf.n_tris++;
+		for (; i!=end && prims[i]->type == 1; i++, leaf.n_spheres++) {
+			Sphere *S = (Sphere *) prims[i];
+			SphereGeom g = {S->center, S->r};
+			spheres.push_back(g);
+		}
+		for (; i!=end && prims[i]->type == 2; i++, leaf.n_ellipsoids++)
+			ellipsoids.push_back(((Ellipsoid *) prims[i])->object_transform());
+		if (leaf.n_tris > 0) {
+			TriBlock block;
+			fill_block(block, &prims[n.offset], leaf.n_tris);
+			leaf.block = blocks.size();
+			blocks.push_back(block);
+		}
+	}
+}
+
+/**
+ * The SAH cost of the tree: the expected cost of the node visits and
+ * surface tests for a ray through the root box.
+ * @return The cost, 0 for an empty tree
+ */
+float BVH::sah_cost() {
+	if (nodes.empty() || nodes[0].box.area() <= 0.0)
+		return 0.0;
+	double cost = 0.0;
+	for (BVHNode& n : nodes)
+		if (n.count > 0)
+			cost += n.box.area()*leaf_cost(n.count, leaves[n.offset].n_tris);
+		else
+			cost += n.box.area()*SAH_TRAVERSAL;
+	return cost/nodes[0].box.area();
+}
+
+/**
+ * Builds the subtree over bp[start, end). For every axis the primitives are
+ * sorted by centroid and every split position is evaluated with the SAH.
+ * @param  bp    The build primitives
+ * @param  start The first primitive of the node
+ * @param  end   One past the last primitive of the node
+ * @param  level The depth of the node
+ * @return       The index of the node
+ */
+int BVH::build_recursive(std::vector<BVHPrim>& bp, int start, int end, int level) {
+	int index = nodes.size();
+	nodes.push_back(BVHNode());
+	depth = std::max(depth, level);
+
+	AABB box, cbox;
+	int tris = 0;
+	for (int i=start; i!=end; i++) {
+		box.grow(bp[i].box);
+		cbox.grow(bp[i].centroid);
+		tris += bp[i].tri;
+	}
+	nodes[index].box = box;
+
+	int n = end - start;
+	float best_cost = leaf_cost(n, tris), area = box.area();
+	int best_axis = -1, best_split = 0;
+
+	if (n > 1 && level < BVH_MAX_DEPTH && area > 0.0) {
+		std::vector<float> right_area(n);
+		std::vector<int> right_tris(n);
+		for (int axis=0; axis!=3; axis++) {
+			if (axis_of(cbox.hi, axis) <= axis_of(cbox.lo, axis))
+				continue;
+			std::sort(bp.begin()+start, bp.begin()+end, [axis](const BVHPrim& a, const BVHPrim& b) {
+				return axis_of(a.centroid, axis) < axis_of(b.centroid, axis);
+			});
+
+			AABB right;
+			for (int i=n-1, count=0; i>0; i--) {
+				right.grow(bp[start+i].box);
+				right_area[i] = right.area();
+				right_tris[i] = count += bp[start+i].tri;
+			}
+
+			AABB left;
+			for (int i=1, count=0; i<n; i++) {
+				left.grow(bp[start+i-1].box);
+				count += bp[start+i-1].tri;
+				float cost = SAH_TRAVERSAL + (left.area()*leaf_cost(i, count) + right_area[i]*leaf_cost(n-i, right_tris[i]))/area;
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_split = i;
+				}
+			}
+		}
+	}
+
+	/* too many surfaces for a leaf and no useful split: cut at the median */
+	if (best_axis == -1 && n > BVH_MAX_LEAF) {
+		Vec3 ext = cbox.hi - cbox.lo;
+		best_axis = (ext.x > ext.y && ext.x > ext.z)? 0: (ext.y > ext.z? 1: 2);
+		best_split = n/2;
+	}
+
+	if (best_axis == -1) {
+		nodes[index].offset = start;
+		nodes[index].count = n;
+		return index;
+	}
+
+	int axis = best_axis;
+	std::sort(bp.begin()+start, bp.begin()+end, [axis](const BVHPrim& a, const BVHPrim& b) {
+		return axis_of(a.centroid, axis) < axis_of(b.centroid, axis);
+	});
+
+	build_recursive(bp, start, start+best_split, level+1);
+	int right = build_recursive(bp, start+best_split, end, level+1);
+	nodes[index].offset = right;
+	nodes[index].count = 0;
+	return index;
+}
+
+/**
+ * A bin of the binned builder: the box of the surfaces whose centroids
+ * fall into it, how many there are and how many of them are triangles.
+ */
+struct Bin {
+	AABB box;
+	int count, tris;
+	Bin() : count(0), tris(0) {}
+};
+
+/**
+ * Adds a surface box to a bin. This is AABB::grow written out so that it
+ * is inlined in the binning loop, which runs once per surface and level.
+ * @param bin The bin
+ * @param p   The surface
+ */
+static inline void add_to_bin(Bin& bin, const BVHPrim& p) {
+	const AABB& box = p.box;
+	AABB& b = bin.box;
+	b.lo.x = fminf(b.lo.x, box.lo.x); b.lo.y = fminf(b.lo.y, box.lo.y); b.lo.z = fminf(b.lo.z, box.lo.z);
+	b.hi.x = fmaxf(b.hi.x, box.hi.x); b.hi.y = fmaxf(b.hi.y, box.hi.y); b.hi.z = fmaxf(b.hi.z, box.hi.z);
+	bin.count++;
+	bin.tris += p.tri;
+}
+
+/**
+ * The bin of a centroid along an axis of the centroid box
+ * @param  c     The centroid
+ * @param  cbox  The box of all centroids of the node
+ * @param  axis  The axis
+ * @param  nbins The number of bins
+ * @return       The bin index in [0, nbins)
+ */
+static inline int bin_of(const Vec3& c, const AABB& cbox, int axis, int nbins) {
+	float lo = axis_of(cbox.lo, axis), hi = axis_of(cbox.hi, axis);
+	int k = (int) (nbins*(axis_of(c, axis) - lo)/(hi - lo));
+	return std::min(std::max(k, 0), nbins-1);
+}
+
+/**
+ * Builds the subtree over bp[start, end) into out, evaluating the SAH only
+ * at the boundaries of up to BINNED_BINS bins per axis (small nodes use
+ * one bin per surface). Large nodes compute their bounds,
+ * bins and partition on several threads, and build their right subtree on
+ * a thread of its own which is spliced into out afterwards.
+ * @param  bp        The build primitives
+ * @param  tmp       Scratch space the size of bp for the partition
+ * @param  start     The first primitive of the node
+ * @param  end       One past the last primitive of the node
+ * @param  level     The depth of the node
+ * @param  threads   The number of threads this subtree may use
+ * @param  out       The nodes of the tree, the subtree is appended
+ * @param  out_depth The deepest level seen
+ * @return           The index of the node in out
+ */
+int BVH::build_binned(std::vector<BVHPrim>& bp, std::vector<BVHPrim>& tmp, int start, int end, int level,
+											int threads, std::vector<BVHNode>& out, int& out_depth) {
+	int index = out.size();
+	out.push_back(BVHNode());
+	out_depth = std::max(out_depth, level);
+
+	int n = end - start;
+	if (n < BINNED_PARALLEL_MIN)
+		threads = 1;
+
+	/* bounds of the boxes and of the centroids, one pair per thread */
+	std::vector<AABB> boxes(threads), cboxes(threads);
+	std::vector<int> counts(threads, 0);
+	parallel_chunks(start, end, threads, [&](int k, int b, int e) {
+		for (int i=b; i!=e; i++) {
+			boxes[k].grow(bp[i].box);
+			cboxes[k].grow(bp[i].centroid);
+			counts[k] += bp[i].tri;
+		}
+	});
+	AABB box, cbox;
+	int tris = 0;
+	for (int k=0; k!=threads; k++) {
+		box.grow(boxes[k]);
+		cbox.grow(cboxes[k]);
+		tris += counts[k];
+	}
+	out[index].box = box;
+
+	float best_cost = leaf_cost(n, tris), area = box.area();
+	int best_axis = -1, best_split = 0, nbins = std::min(n, BINNED_BINS);
+
+	if (n > 1 && level < BVH_MAX_DEPTH && area > 0.0) {
+		/* bin the centroids on every axis, one set of bins per thread */
+		Bin local[3*BINNED_BINS], *bins = local;
+		std::vector<Bin> shared;
+		if (threads > 1) {
+			shared.resize(threads*3*BINNED_BINS);
+			bins = &shared[0];
+		}
+		parallel_chunks(start, end, threads, [&](int k, int b, int e) {
+			Bin *mine = &bins[k*3*BINNED_BINS];
+			for (int axis=0; axis!=3; axis++) {
+				if (axis_of(cbox.hi, axis) <= axis_of(cbox.lo, axis))
+					continue;
+				for (int i=b; i!=e; i++)
+					add_to_bin(mine[axis*BINNED_BINS + bin_of(bp[i].centroid, cbox, axis, nbins)], bp[i]);
+			}
+		});
+		for (int k=1; k<threads; k++)
+			for (int j=0; j!=3*BINNED_BINS; j++) {
+				bins[j].box.grow(bins[k*3*BINNED_BINS + j].box);
+				bins[j].count += bins[k*3*BINNED_BINS + j].count;
+				bins[j].tris += bins[k*3*BINNED_BINS + j].tris;
+			}
+
+		/* sweep the bin boundaries */
+		for (int axis=0; axis!=3; axis++) {
+			if (axis_of(cbox.hi, axis) <= axis_of(cbox.lo, axis))
+				continue;
+			Bin *b = &bins[axis*BINNED_BINS];
+			float right_area[BINNED_BINS];
+			int right_count[BINNED_BINS], right_tris[BINNED_BINS];
+			AABB right; int count = 0, tri_count = 0;
+			for (int j=nbins-1; j>0; j--) {
+				if (b[j].count > 0) {
+					right.grow(b[j].box);
+					count += b[j].count;
+					tri_count += b[j].tris;
+				}
+				right_area[j] = right.area();
+				right_count[j] = count;
+				right_tris[j] = tri_count;
+			}
+			AABB left; count = 0, tri_count = 0;
+			for (int j=1; j<nbins; j++) {
+				if (b[j-1].count > 0) {
+					left.grow(b[j-1].box);
+					count += b[j-1].count;
+					tri_count += b[j-1].tris;
+				}
+				if (count == 0 || right_count[j] == 0)
+					continue;
+				float cost = SAH_TRAVERSAL + (left.area()*leaf_cost(count, tri_count) +
+																			right_area[j]*leaf_cost(right_count[j], right_tris[j]))/area;
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_split = j;
+				}
+			}
+		}
+	}
+
+	int mid = start;
+	if (best_axis != -1) {
+		int axis = best_axis, split = best_split;
+		auto goes_left = [&](const BVHPrim& p) { return bin_of(p.centroid, cbox, axis, nbins) < split; };
+		if (threads == 1)
+			mid = std::partition(bp.begin()+start, bp.begin()+end, goes_left) - bp.begin();
+		else {
+			/* each thread counts its chunk, then scatters it into tmp */
+			std::vector<int> lefts(threads+1, 0), rights(threads+1, 0);
+			parallel_chunks(start, end, threads, [&](int k, int b, int e) {
+				for (int i=b; i!=e; i++)
+					goes_left(bp[i])? lefts[k+1]++: rights[k+1]++;
+			});
+			for (int k=0; k!=threads; k++) {
+				lefts[k+1] += lefts[k];
+				rights[k+1] += rights[k];
+			}
+			mid = start + lefts[threads];
+			parallel_chunks(start, end, threads, [&](int k, int b, int e) {
+				int l = start + lefts[k], r = mid + rights[k];
+				for (int i=b; i!=e; i++)
+					tmp[goes_left(bp[i])? l++: r++] = bp[i];
+			});
+			parallel_chunks(start, end, threads, [&](int /*k*/, int b, int e) {
+				std::copy(tmp.begin()+b, tmp.begin()+e, bp.begin()+b);
+			});
+		}
+	}
+	else if (n > BVH_MAX_LEAF) {
+		/* too many surfaces for a leaf and no useful split: cut at the median */
+		Vec3 ext = cbox.hi - cbox.lo;
+		int axis = (ext.x > ext.y && ext.x > ext.z)? 0: (ext.y > ext.z? 1: 2);
+		mid = start + n/2;
+		std::nth_element(bp.begin()+start, bp.begin()+mid, bp.begin()+end, [axis](const BVHPrim& a, const BVHPrim& b) {
+			return axis_of(a.centroid, axis) < axis_of(b.centroid, axis);
+		});
+	}
+	else {
+		out[index].offset = start;
+		out[index].count = n;
+		return index;
+	}
+
+	if (threads > 1) {
+		/* build the right subtree on its own thread and splice it in */
+		std::vector<BVHNode> right_nodes;
+		int right_depth = 0, half = threads/2;
+		std::thread worker(build_binned, std::ref(bp), std::ref(tmp), mid, end, level+1, threads-half,
+											 std::ref(right_nodes), std::ref(right_depth));
+		build_binned(bp, tmp, start, mid, level+1, half, out, out_depth);
+		worker.join();
+
+		int base = out.size();
+		for (BVHNode node : right_nodes) {
+			if (node.count == 0)
+				node.offset += base;
+			out.push_back(node);
+		}
+		out_depth = std::max(out_depth, right_depth);
+		out[index].offset = base;
+	}
+	else {
+		build_binned(bp, tmp, start, mid, level+1, 1, out, out_depth);
+		out[index].offset = build_binned(bp, tmp, mid, end, level+1, 1, out, out_depth);
+	}
+	out[index].count = 0;
+	return index;
+}
+
+/**
+ * The axis along which two sibling boxes are separated the most. Used to
+ * order the children of a wide node.
+ * @param  a The first box
+ * @param  b The second box
+ * @return   0 for x, 1 for y, 2 for z
+ */
+static int split_axis(const AABB& a, const AABB& b) {
+	Vec3 d = b.centroid() - a.centroid();
+	d = Vec3(fabsf(d.x), fabsf(d.y), fabsf(d.z));
+	return (d.x >= d.y && d.x >= d.z)? 0: (d.y >= d.z? 1: 2);
+}
+
+/**
+ * Collapses the binary subtree rooted at node b into 4-wide nodes. The
+ * children of b and their children (if they are not leaves) become the
+ * slots of the wide node: 0,1 from the left child and 2,3 from the right.
+ * @param  b The binary node
+ * @return   The index of the wide node
+ */
+int BVH::collapse(int b) {
+	int index = wide.size();
+	wide.push_back(BVH4Node());
+	wide_slots.resize(wide_slots.size() + 4);
+
+	int slots[4] = {-1, -1, -1, -1};
+	unsigned char axis[3] = {0, 0, 0};
+	if (nodes[b].count > 0)
+		slots[0] = b;
+	else {
+		int pair[2] = {b+1, nodes[b].offset};
+		axis[0] = split_axis(nodes[pair[0]].box, nodes[pair[1]].box);
+		for (int k=0; k!=2; k++) {
+			int c = pair[k];
+			if (nodes[c].count > 0)
+				slots[2*k] = c;
+			else {
+				slots[2*k] = c+1;
+				slots[2*k+1] = nodes[c].offset;
+				axis[1+k] = split_axis(nodes[c+1].box, nodes[nodes[c].offset].box);
+			}
+		}
+	}
+
+	for (int i=0; i!=4; i++) {
+		AABB box; // empty unless the slot is used
+		int child = 0, count = -1;
+		if (slots[i] != -1) {
+			const BVHNode& n = nodes[slots[i]];
+			box = n.box;
+			count = n.count;
+			child = n.count > 0? n.offset: collapse(slots[i]);
+		}
+		BVH4Node& w = wide[index];
+		set_slot(w, i, box);
+		w.child[i] = child;
+		w.count[i] = count;
+		wide_slots[4*index+i] = slots[i];
+	}
+	for (int k=0; k!=3; k++)
+		wide[index].axis[k] = axis[k];
+	return index;
+}
+
+/**
+ * Fills in the hit record of lane of a block
+ * @param hits    The hits of the block
+ * @param lane    The lane
+ * @param s       The triangle in the lane
+ * @param out_hit The record of the hit
+ */
+static inline void lane_hit(const BlockHits& hits, int lane, Surface *s, Hit& out_hit) {
+	out_hit.t = out_hit.t_max = hits.t[lane];
+	out_hit.alpha = hits.alpha[lane], out_hit.beta = hits.beta[lane], out_hit.gamma = hits.gamma[lane];
+	out_hit.surface = out_hit.prim = s;
+}
+
+/**
+ * Sphere::hit from the geometry of the sphere
+ * @param  s         The sphere
+ * @param  ray       The ray
+ * @param  out_t_max The far root
+ * @return           The near root, -1 if the ray misses
+ */
+static inline float hit_sphere(const SphereGeom& s, const Ray& ray, float& out_t_max) {
+	return solve_sphere(ray.org - s.center, ray.dir, s.r*s.r, out_t_max);
+}
+
+/**
+ * Ellipsoid::hit from the transform of the ellipsoid
+ * @param  to_object The transform onto the unit sphere
+ * @param  ray       The ray
+ * @param  out_t_max The far root
+ * @return           The near root, -1 if the ray misses
+ */
+static inline float hit_ellipsoid(const Transform& to_object, const Ray& ray, float& out_t_max) {
+	return solve_sphere(to_object.point(ray.org), to_object.vector(ray.dir), 1.0, out_t_max);
+}
+
+/**
+ * Whether a hit at t is closer than the closest one so far. Ties go to the
+ * surface that comes first in the scene.
+ * @param  t       The t of the hit
+ * @param  id      The scene position of its surface
+ * @param  out_hit The closest hit so far
+ * @param  best_id The scene position of its surface, updated if closer
+ * @return         true if the hit is closer
+ */
+static inline bool closer(float t, int id, const Hit& out_hit, int& best_id) {
+	if (!(t > 0.0 && (t < out_hit.t || (t == out_hit.t && id < best_id))))
+		return false;
+	best_id = id;
+	return true;
+}
+
+/**
+ * Tests the surfaces of a leaf and keeps the closest hit, one run of
+ * surfaces of the same type after the other
+ * @param first   The first surface of the leaf
+ * @param count   The number of surfaces
+ * @param ray     The ray
+ * @param sr      The ray, sheared for the block
+ * @param out_hit The closest hit so far, updated
+ * @param best_id The scene position of its surface, updated
+ */
+inline void BVH::closest_in_leaf(int first, int count, const Ray& ray, const ShearedRay& sr, Hit& out_hit,
+																 int& best_id) {
+	const BVHLeaf& leaf = leaves[first];
+	int i = first;
+	if (leaf.n_tris > 0) {
+		BlockHits bh;
+		intersect_block(blocks[leaf.block], sr, bh);
+		for (int lane=0; lane!=leaf.n_tris; lane++, i++)
+			if (closer(bh.t[lane], prim_ids[i], out_hit, best_id))
+				lane_hit(bh, lane, prims[i], out_hit);
+	}
+	float t, t_max;
+	for (int k=0; k!=leaf.n_spheres; k++, i++)
+		if (closer(t = hit_sphere(spheres[leaf.spheres+k], ray, t_max), prim_ids[i], out_hit, best_id)) {
+			out_hit = Hit();
+			out_hit.t = t; out_hit.t_max = t_max;
+			out_hit.surface = out_hit.prim = prims[i];
+		}
+	for (int k=0; k!=leaf.n_ellipsoids; k++, i++)
+		if (closer(t = hit_ellipsoid(ellipsoids[leaf.ellipsoids+k], ray, t_max), prim_ids[i], out_hit, best_id)) {
+			out_hit = Hit();
+			out_hit.t = t; out_hit.t_max = t_max;
+			out_hit.surface = out_hit.prim = prims[i];
+		}
+	Hit h;
+	for (; i!=first+count; i++)
+		if (closer(prims[i]->hit(ray, h), prim_ids[i], out_hit, best_id))
+			out_hit = h;
+}
+
+/**
+ * Finds the surface whose first intersection is the closest one in front
+ * of the origin. Ties are broken by the order of the surfaces in the scene
+ * so the result matches a linear scan.
+ * @param  ray     The ray to trace
+ * @param  out_hit The hit of the closest surface, t is INFINITY if none
+ * @return         The closest surface, or NULL if none is hit
+ */
+Surface* BVH::closest_hit(Ray ray, Hit& out_hit) {
+	if (layout == BVH_QUANTIZED)
+		return closest_hit_in(qwide, ray, out_hit);
+	return closest_hit_in(wide, ray, out_hit);
+}
+
+/**
+ * closest_hit over the wide nodes of either layout
+ * @param  tree    The wide nodes, wide or qwide
+ * @param  ray     The ray to trace
+ * @param  out_hit The hit of the closest surface, t is INFINITY if none
+ * @return         The closest surface, or NULL if none is hit
+ */
+template <class Node>
+Surface* BVH::closest_hit_in(const std::vector<Node>& tree, Ray ray, Hit& out_hit) {
+	out_hit = Hit();
+	if (tree.empty())
+		return NULL;
+
+	RayData rd(ray);
+	ShearedRay sr(ray);
+	int stack[BVH_STACK], counts[BVH_STACK], sp = 0, best_id = INT_MAX;
+	stack[sp] = 0; counts[sp++] = 0;
+
+	while (sp > 0) {
+		int node = stack[--sp], count = counts[sp];
+		if (count > 0) {
+			closest_in_leaf(node, count, ray, sr, out_hit, best_id);
+			continue;
+		}
+
+		const Node& w = tree[node];
+		float t_near[4];
+		int mask = hit_children(w, rd, out_hit.t, t_near), order[4];
+		child_order(w, rd, order);
+		/* push far to near so the nearest child is popped first */
+		for (int k=3; k>=0; k--) {
+			int i = order[k];
+			if ((mask & (1<<i)) && w.count[i] >= 0) {
+				stack[sp] = w.child[i];
+				counts[sp++] = w.count[i];
+			}
+		}
+	}
+
+	return out_hit.surface;
+}
+
+/**
+ * Finds the closest hits of a packet of coherent rays, like the primary
+ * rays of a screen tile, in chunks of at most PACKET_MAX rays. The results
+ * are those of closest_hit for each ray.
+ * @param rays     The rays
+ * @param n        The number of rays
+ * @param out_hits The closest hit of each ray, with a NULL surface if none
+ */
+void BVH::closest_hits(const Ray *rays, int n, Hit *out_hits) {
+	for (int i=0; i<n; i+=PACKET_MAX) {
+		int m = std::min(n-i, PACKET_MAX);
+		if (layout == BVH_QUANTIZED)
+			closest_hits_in(qwide, rays+i, m, out_hits+i);
+		else
+			closest_hits_in(wide, rays+i, m, out_hits+i);
+	}
+}
+
+/**
+ * closest_hits over the wide nodes of either layout. Every node is fetched
+ * once for the packet, which carries the range [first, last] of rays that
+ * may still hit it. The interval test first culls the children missed by
+ * the whole packet, then each child gets the first and last ray whose own
+ * slab test hits it; children hit by no ray are dropped and the others are
+ * visited with the narrower range. At a leaf, the rays inside the range
+ * test the leaf box again before its surfaces.
+ * @param tree     The wide nodes, wide or qwide
+ * @param rays     The rays, at most PACKET_MAX
+ * @param n        The number of rays
+ * @param out_hits The closest hit of each ray, with a NULL surface if none
+ */
+template <class Node>
+void BVH::closest_hits_in(const std::vector<Node>& tree, const Ray *rays, int n, Hit *out_hits) {
+	for (int r=0; r!=n; r++)
+		out_hits[r] = Hit();
+	if (tree.empty() || n == 0)
+		return;
+
+	std::vector<RayData> rd(rays, rays+n);
+	std::vector<ShearedRay> sr(rays, rays+n);
+	PacketData pd(rd.data(), n);
+	int best_id[PACKET_MAX];
+	std::fill(best_id, best_id+n, INT_MAX);
+	int stack[BVH_STACK], counts[BVH_STACK], firsts[BVH_STACK], lasts[BVH_STACK], parents[BVH_STACK], sp = 0;
+	stack[sp] = 0; counts[sp] = 0; firsts[sp] = 0; lasts[sp] = n-1; parents[sp++] = -1;
+
+	while (sp > 0) {
+		--sp;
+		int node = stack[sp], count = counts[sp], first = firsts[sp], last = lasts[sp], parent = parents[sp];
+		if (count > 0) {
+			/* the rays between first and last may have missed the leaf box, test it again */
+			const Node& w = tree[parent >> 2];
+			float t_near[4];
+			for (int r=first; r<=last; r++) {
+				if (r != first && r != last && !(hit_children(w, rd[r], out_hits[r].t, t_near) & (1 << (parent & 3))))
+					continue;
+				closest_in_leaf(node, count, rays[r], sr[r], out_hits[r], best_id[r]);
+			}
+			continue;
+		}
+
+		const Node& w = tree[node];
+		int mask = 0;
+		for (int i=0; i!=4; i++)
+			mask |= (w.count[i] >= 0) << i;
+		if (pd.usable) {
+			float t_max = 0.0;
+			for (int r=first; r<=last; r++)
+				t_max = std::max(t_max, out_hits[r].t);
+			mask &= hit_children_packet(w, pd, t_max);
+		}
+
+		/* the first and last ray hitting each child */
+		int lo[4], hi[4], todo = mask;
+		float t_near[4];
+		for (int r=first; r<=last && todo; r++) {
+			int hit = hit_children(w, rd[r], out_hits[r].t, t_near) & todo;
+			for (int i=0; i!=4; i++)
+				if (hit & (1<<i))
+					lo[i] = r;
+			todo &= ~hit;
+		}
+		mask &= ~todo;
+		todo = mask;
+		for (int r=last; todo; r--) {
+			int hit = hit_children(w, rd[r], out_hits[r].t, t_near) & todo;
+			for (int i=0; i!=4; i++)
+				if (hit & (1<<i))
+					hi[i] = r;
+			todo &= ~hit;
+		}
+
+		int order[4];
+		child_order(w, rd[first], order);
+		/* push far to near so the nearest child is popped first */
+		for (int k=3; k>=0; k--) {
+			int i = order[k];
+			if (mask & (1<<i)) {
+				stack[sp] = w.child[i];
+				counts[sp] = w.count[i];
+				firsts[sp] = lo[i];
+				lasts[sp] = hi[i];
+				parents[sp++] = 4*node + i;
+			}
+		}
+	}
+}
+
+/**
+ * Counts an occluder of a shadow ray
+ * @param  alpha     Its alpha
+ * @param  out_alpha The sum of the alphas of the transparent occluders
+ * @param  out_count The number of transparent occluders
+ * @return           true if it is opaque and blocks the ray
+ */
+static inline bool occludes(float alpha, float& out_alpha, int& out_count) {
+	if (alpha >= 1.0)
+		return true;
+	out_alpha += alpha;
+	out_count++;
+	return false;
+}
+
+/**
+ * Occlusion query for shadow rays. Looks for surfaces hit in (0, t_max] and
+ * stops at the first opaque one (alpha 1.0). The alpha of the transparent
+ * surfaces crossed on the way is summed up.
+ * @param  ray       The shadow ray
+ * @param  t_max     The distance to the light source
+ * @param  ignore    The surface the ray starts from, never counted
+ * @param  out_alpha The sum of the alphas of the transparent occluders
+ * @param  out_count The number of transparent occluders
+ * @return           true if an opaque surface blocks the ray
+ */
+bool BVH::any_hit(Ray ray, float t_max, Surface *ignore, float& out_alpha, int& out_count) {
+	if (layout == BVH_QUANTIZED)
+		return any_hit_in(qwide, ray, t_max, ignore, out_alpha, out_count);
+	return any_hit_in(wide, ray, t_max, ignore, out_alpha, out_count);
+}
+
+/**
+ * any_hit over the wide nodes of either layout
+ * @param  tree      The wide nodes, wide or qwide
+ * @param  ray       The shadow ray
+ * @param  t_max     The distance to the light source
+ * @param  ignore    The surface the ray starts from, never counted
+ * @param  out_alpha The sum of the alphas of the transparent occluders
+ * @param  out_count The number of transparent occluders
+ * @return           true if an opaque surface blocks the ray
+ */
+template <class Node>
+bool BVH::any_hit_in(const std::vector<Node>& tree, Ray ray, float t_max, Surface *ignore, float& out_alpha,
+										 int& out_count) {
+	out_alpha = 0.0; out_count = 0;
+	if (tree.empty())
+		return false;
+
+	RayData rd(ray);
+	ShearedRay sr(ray);
+	int stack[BVH_STACK], counts[BVH_STACK], sp = 0;
+	Hit h;
+	BlockHits bh;
+	stack[sp] = 0; counts[sp++] = 0;
+
+	while (sp > 0) {
+		int node = stack[--sp], count = counts[sp];
+		if (count > 0) {
+			const BVHLeaf& leaf = leaves[node];
+			int i = node;
+			float t, far;
+			if (leaf.n_tris > 0)
+				intersect_block(blocks[leaf.block], sr, bh);
+			for (int lane=0; lane!=leaf.n_tris; lane++, i++)
+				if (prims[i] != ignore && (t = bh.t[lane]) > 0.0 && t <= t_max &&
+						occludes(prims[i]->mtl_color.alpha, out_alpha, out_count))
+					return true;
+			for (int k=0; k!=leaf.n_spheres; k++, i++)
+				if (prims[i] != ignore && (t = hit_sphere(spheres[leaf.spheres+k], ray, far)) > 0.0 && t <= t_max &&
+						occludes(prims[i]->mtl_color.alpha, out_alpha, out_count))
+					return true;
+			for (int k=0; k!=leaf.n_ellipsoids; k++, i++)
+				if (prims[i] != ignore && (t = hit_ellipsoid(ellipsoids[leaf.ellipsoids+k], ray, far)) > 0.0 &&
+						t <= t_max && occludes(prims[i]->mtl_color.alpha, out_alpha, out_count))
+					return true;
+			for (; i!=node+count; i++)
+				if (prims[i] != ignore && (t = prims[i]->hit(ray, h)) > 0.0 && t <= t_max &&
+						occludes(h.prim->mtl_color.alpha, out_alpha, out_count))
+					return true;
+			continue;
+		}
+
+		const Node& w = tree[node];
+		float t_near[4];
+		int mask = hit_children(w, rd, t_max, t_near);
+		for (int i=0; i!=4; i++)
+			if ((mask & (1<<i)) && w.count[i] >= 0) {
+				stack[sp] = w.child[i];
+				counts[sp++] = w.count[i];
+			}
+	}
+
+	return false;
+}
+
+/**
+ * The box enclosing all surfaces in the tree, empty if there are none
+ * @return The bounding box
+ */
+AABB BVH::get_bounds() {
+	return nodes.empty()? AABB(): nodes[0].box;
+}
+
+/**
+ * Number of nodes in the tree
+ * @return The node count
+ */
+int BVH::node_count() {
+	return nodes.size();
+}
+
+/**
+ * The size of the wide nodes, which are what traversal reads
+ * @return The size in bytes
+ */
+size_t BVH::node_bytes() {
+	return wide.size()*sizeof(BVH4Node) + qwide.size()*sizeof(QBVH4Node);
+}
+
+/**
+ * The size of all the nodes and surface lists, including the binary nodes
+ * kept for refitting
+ * @return The size in bytes
+ */
+size_t BVH::memory() {
+	return node_bytes() + nodes.size()*sizeof(BVHNode) + wide_slots.size()*sizeof(int) +
+		prims.size()*sizeof(Surface*) + prim_ids.size()*sizeof(int) + blocks.size()*sizeof(TriBlock) +
+		spheres.size()*sizeof(SphereGeom) + ellipsoids.size()*sizeof(Transform) + leaves.size()*sizeof(BVHLeaf);
+}
+
+/**
+ * Prints statistics about the tree
+ */
+void BVH::print() {
+	int leaf_count = 0;
+	for (BVHNode& n : nodes)
+		leaf_count += n.count > 0;
+	printf("BVH:= surfaces: %zu nodes: %i leaves: %i depth: %i wide nodes: %zu (%s, %zu bytes) triangle blocks: %zu (%s) spheres: %zu ellipsoids: %zu\n",
+		prims.size(), node_count(), leaf_count, depth, wide_slots.size()/4, layout==BVH_QUANTIZED? "quantized": "float",
+		node_bytes(), blocks.size(), block_kernel(), spheres.size(), ellipsoids.size());
+}
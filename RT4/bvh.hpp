@@ -0,0 +1,162 @@
+#ifndef _BVH_HPP
+#define _BVH_HPP
+
+#include <vector>
+
+#include "accel.hpp"
+#include "geometry.hpp"
+#include "surfaces.hpp"
+#include "triblock.hpp"
+
+/**
+ * A node of the flattened BVH.
+ * Inner nodes have count == 0. Their first child is stored right after the
+ * node and offset is the index of the second child.
+ * Leaves have count > 0 and hold the surfaces prims[offset, offset+count).
+ */
+struct BVHNode {
+	AABB box;
+	int offset;
+	int count;
+};
+
+/** The geometry of a sphere, all its intersection needs, 16 bytes */
+struct SphereGeom {
+	Vec3 center;
+	float r;
+};
+
+/**
+ * The surfaces of a leaf, which the builder sorts by type: triangles,
+ * spheres, ellipsoids, then all others. Each run is tested by its own
+ * kernel from an array holding only the geometry of that type, so the
+ * surfaces, with their materials, are only read for a hit. The others,
+ * instances and sphere clouds, are tested with hit.
+ * block:	the TriBlock of the triangles, -1 if there are none
+ * spheres:	the first sphere of the leaf in BVH::spheres
+ * ellipsoids:	the first ellipsoid of the leaf in BVH::ellipsoids
+ */
+struct BVHLeaf {
+	int block;
+	int spheres;
+	int ellipsoids;
+	unsigned char n_tris, n_spheres, n_ellipsoids;
+};
+
+/**
+ * A node of the 4-wide BVH, made by collapsing two levels of the binary
+ * tree. The child boxes are stored as structure-of-arrays so that one SSE
+ * slab test covers all four children.
+ * child[i] is a wide node when count[i] == 0, the first surface of a leaf
+ * when count[i] > 0, and the slot is unused when count[i] < 0.
+ * axis holds the split axes of the top, left and right binary nodes and is
+ * used to visit the children front to back.
+ */
+struct BVH4Node {
+	float lo_x[4], lo_y[4], lo_z[4];
+	float hi_x[4], hi_y[4], hi_z[4];
+	int child[4];
+	int count[4];
+	unsigned char axis[4];
+};
+
+/**
+ * A 4-wide node with its child boxes quantized to 8 bits, 64 bytes instead
+ * of the 132 of BVH4Node. The child boxes are stored on a grid relative to
+ * the box around them: on each axis a value q stands for
+ * origin + q*2^exp. The grid is rounded outwards so the quantized boxes
+ * always enclose the real ones. child, count and axis are as in BVH4Node;
+ * leaves never hold more than BVH_MAX_LEAF surfaces so count fits a byte.
+ */
+struct QBVH4Node {
+	float origin[3];
+	signed char exp[3];
+	unsigned char axis[3];
+	unsigned char lo_x[4], lo_y[4], lo_z[4];
+	unsigned char hi_x[4], hi_y[4], hi_z[4];
+	int child[4];
+	signed char count[4];
+};
+
+/**
+ * The builders: BVH_SAH evaluates every split position with the SAH and
+ * gives the best trees, BVH_BINNED evaluates only bin boundaries and runs
+ * on all cores, for very large meshes and quick previews.
+ */
+enum BVHBuilder { BVH_SAH, BVH_BINNED };
+
+/**
+ * The node layouts used for traversal: BVH_FLOAT stores the child boxes as
+ * floats (BVH4Node), BVH_QUANTIZED as bytes (QBVH4Node) for large scenes
+ * where traversal is limited by memory bandwidth.
+ */
+enum BVHLayout { BVH_FLOAT, BVH_QUANTIZED };
+
+/** Per-surface data used while building. Defined in bvh.cpp */
+struct BVHPrim;
+
+/**
+ * Bounding volume hierarchy over the scene surfaces, built with the
+ * surface area heuristic as a binary tree and then collapsed into a 4-wide
+ * tree for traversal. It is derived from Accelerator; the builder and the
+ * node layout are given to the constructor or to build. The surfaces of
+ * each leaf are grouped by type as described by BVHLeaf; its triangles are
+ * copied into a TriBlock and intersected together.
+ * 	build:	builds the tree over the given surfaces
+ * 	refit:	updates the boxes after the surfaces moved, or rebuilds the
+ * 		tree if refitting made it too slow to traverse
+ * 	sah_cost:	the expected cost of tracing a ray through the tree
+ * 	node_bytes:	the size of the nodes used for traversal
+ * 	memory:	the size of the whole tree
+ * 	closest_hit:	finds the closest surface hit by the ray, like trace_ray
+ * 	closest_hits:	closest_hit for a packet of coherent rays, traced together
+ * 	any_hit:	occlusion query for shadow rays
+ * 	get_bounds:	the box enclosing the whole tree
+ * 	node_count:	number of nodes in the tree
+ * 	print:	prints statistics about the tree
+ */
+class BVH : public Accelerator {
+	std::vector<BVHNode> nodes;
+	std::vector<BVH4Node> wide;
+	std::vector<QBVH4Node> qwide; // the wide nodes in the quantized layout
+	std::vector<int> wide_slots; // the binary node behind each wide slot, -1 if unused
+	std::vector<Surface*> prims;
+	std::vector<int> prim_ids; // position in the scene, used to break ties
+	std::vector<TriBlock> blocks;
+	std::vector<SphereGeom> spheres;
+	std::vector<Transform> ellipsoids; // their to_object
+	std::vector<BVHLeaf> leaves; // the leaf starting at each surface
+	int depth;
+	BVHBuilder builder;
+	BVHLayout layout;
+	float build_cost; // sah_cost right after the last build
+	int build_recursive(std::vector<BVHPrim>& bp, int start, int end, int level);
+	static int build_binned(std::vector<BVHPrim>& bp, std::vector<BVHPrim>& tmp, int start, int end, int level,
+													int threads, std::vector<BVHNode>& out, int& out_depth);
+	int collapse(int b);
+	void quantize(int w);
+	void refit_range(int start, int end);
+	void fill_leaves();
+	void closest_in_leaf(int first, int count, const Ray& ray, const ShearedRay& sr, Hit& out_hit, int& best_id);
+	template <class Node> Surface* closest_hit_in(const std::vector<Node>& tree, Ray ray, Hit& out_hit);
+	template <class Node> void closest_hits_in(const std::vector<Node>& tree, const Ray *rays, int n,
+																						 Hit *out_hits);
+	template <class Node> bool any_hit_in(const std::vector<Node>& tree, Ray ray, float t_max, Surface *ignore,
+																				float& out_alpha, int& out_count);
+public:
+	BVH(BVHBuilder builder=BVH_SAH, BVHLayout layout=BVH_FLOAT);
+	void build(const std::vector<Surface*>& surfaces);
+	void build(const std::vector<Surface*>& surfaces, BVHBuilder builder, BVHLayout layout);
+	bool refit();
+	float sah_cost();
+	Surface* closest_hit(Ray ray, Hit& out_hit);
+	void closest_hits(const Ray *rays, int n, Hit *out_hits);
+	bool any_hit(Ray ray, float t_max, Surface *ignore, float& out_alpha, int& out_count);
+	AABB get_bounds();
+	int node_count();
+	size_t node_bytes();
+	size_t memory();
+	void print();
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include "checkpoint.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "allexceptions.hpp"
+
+#define CHECKPOINT_MAGIC "RT4CKPT2"	// the start of a checkpoint file, with the version of the format
+
+/**
+ * Writes a vector to a file, its size first
+ * @param  fp The file
+ * @param  v  The vector
+ * @return    false if the write failed
+ */
+template <typename T>
+static bool write_vector(FILE *fp, const std::vector<T>& v) {
+	unsigned long long size = v.size();
+	return fwrite(&size, sizeof(size), 1, fp) == 1 && fwrite(v.data(), sizeof(T), v.size(), fp) == v.size();
+}
+
+/**
+ * Reads a vector written by write_vector
+ * @param  fp  The file
+ * @param  v   The vector
+ * @param  max The most elements it can have, a larger size is an error
+ * @return     false if the read failed
+ */
+template <typename T>
+static bool read_vector(FILE *fp, std::vector<T>& v, size_t max) {
+	unsigned long long size;
+	if (fread(&size, sizeof(size), 1, fp) != 1 || size > max)
+		return false;
+	v.resize(size);
+	return fread(v.data(), sizeof(T), v.size(), fp) == v.size();
+}
+
+/**
+ * Writes the checkpoint next to path and renames it over path, so a crash
+ * while writing leaves the last checkpoint whole.
+ * @param path The file
+ */
+void Checkpoint::save(std::string path) {
+	std::string tmp = path + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (!fp)
+		throw checkpoint_error(tmp + ": " + strerror(errno));
+	int header[] = {width, height, depth, shadow_bundle, passes, sample, rect.x0, rect.y0, rect.x1, rect.y1};
+	bool ok = fwrite(CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC), 1, fp) == 1 &&
+						fwrite(&scene, sizeof(scene), 1, fp) == 1 && fwrite(&seed, sizeof(seed), 1, fp) == 1 &&
+						fwrite(header, sizeof(header), 1, fp) == 1 &&
+						write_vector(fp, tiles) && write_vector(fp, counts) && write_vector(fp, sum);
+	ok = fclose(fp) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		std::string err = strerror(errno);
+		remove(tmp.c_str());
+		throw checkpoint_error(path + ": " + err);
+	}
+}
+
+/**
+ * Reads a checkpoint
+ * @param  path The file
+ * @return      false if there is no such file
+ */
+bool Checkpoint::load(std::string path) {
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp)
+		return false;
+	char magic[sizeof(CHECKPOINT_MAGIC)] = {0};
+	int header[10];
+	bool ok = fread(magic, strlen(CHECKPOINT_MAGIC), 1, fp) == 1 && strcmp(magic, CHECKPOINT_MAGIC) == 0 &&
+						fread(&scene, sizeof(scene), 1, fp) == 1 && fread(&seed, sizeof(seed), 1, fp) == 1 &&
+						fread(header, sizeof(header), 1, fp) == 1 && header[0] > 0 && header[1] > 0 &&
+						header[5] >= 0 && header[5] <= header[4];
+	if (ok) {
+		width = header[0]; height = header[1]; depth = header[2];
+		shadow_bundle = header[3]; passes = header[4]; sample = header[5];
+		rect = Rect{header[6], header[7], header[8], header[9]};
+		size_t pixels = (size_t) width*height;
+		ok = read_vector(fp, tiles, pixels) && read_vector(fp, counts, pixels) && read_vector(fp, sum, pixels) &&
+				 counts.size() == pixels && sum.size() == pixels;
+	}
+	fclose(fp);
+	if (!ok)
+		throw checkpoint_error(path + " is not a checkpoint or is damaged");
+	return true;
+}
+
+/**
+ * If the other checkpoint renders the same image: the same scene, size,
+ * rectangle, seed and settings. Where the render is does not count.
+ * @param  other The other checkpoint
+ * @return       true if they match
+ */
+bool Checkpoint::matches(const Checkpoint& other) {
+	return scene == other.scene && seed == other.seed && width == other.width && height == other.height &&
+				 depth == other.depth && shadow_bundle == other.shadow_bundle && passes == other.passes &&
+				 rect.x0 == other.rect.x0 && rect.y0 == other.rect.y0 && rect.x1 == other.rect.x1 &&
+				 rect.y1 == other.rect.y1 && tiles.size() == other.tiles.size();
+}
+
+/**
+ * A hash of the contents of a file, FNV-1a
+ * @param  path The file
+ * @return      The hash, that of no bytes if the file cannot be read
+ */
+unsigned long long file_hash(std::string path) {
+	unsigned long long hash = 14695981039346656037ULL;
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp)
+		return hash;
+	int c;
+	while ((c = getc(fp)) != EOF)
+		hash = (hash ^ (unsigned char) c)*1099511628211ULL;
+	fclose(fp);
+	return hash;
+}
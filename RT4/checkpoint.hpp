@@ -0,0 +1,41 @@
+#ifndef _CHECKPOINT_HPP
+#define _CHECKPOINT_HPP
+
+#include <string>
+#include <vector>
+
+#include "geometry.hpp"
+#include "image.hpp"
+
+/**
+ * The state of a progressive render, which is written to a file now and
+ * then so that a render that was stopped can be resumed and still give
+ * the same image. The random numbers are streams keyed by the seed and
+ * numbered by the pass and the pixel, so the seed and the pass are all
+ * the state they have. A pass is rendered in tiles and every tile is
+ * added into the sum as soon as it is done.
+ * 	save:		writes the checkpoint to a temporary file and renames it
+ * 	load:		reads a checkpoint, false if there is none
+ * 	matches:	if a checkpoint is of the same scene and options
+ */
+struct Checkpoint {
+	unsigned long long scene; // hash of the scene file
+	unsigned long long seed;
+	int width, height, depth, shadow_bundle, passes;
+	Rect rect; // the pixels rendered
+	int sample; // the pass being rendered
+	std::vector<char> tiles; // the tiles of that pass that are in the sum, in scanline order
+	std::vector<int> counts; // the passes in the sum of each pixel
+	std::vector<Color> sum; // the passes added up
+
+	void save(std::string path);
+	bool load(std::string path);
+	bool matches(const Checkpoint& other);
+};
+
+/**
+ * A hash of the contents of a file, FNV-1a
+ */
+unsigned long long file_hash(std::string path);
+
+#endif
@@ -0,0 +1,336 @@
+#include "cloud.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "allexceptions.hpp"
+
+#define CLOUD_STACK 64	// the tree is split at the median, so it is never deeper than this
+#define CLOUD_EPS 1e-3	// a ray from closer than this times r^2 to the surface starts on the particle
+
+/**
+ * Per-ray data for the cloud: origin, direction, inverse direction for the
+ * slab tests, and a = dir.dir with its inverse for the quadratic. a is not
+ * assumed to be 1.
+ */
+struct CloudRay {
+	float org[3], dir[3], inv_dir[3];
+	float a, inv_a;
+	CloudRay(const Ray& ray) {
+		org[0] = ray.org.x; org[1] = ray.org.y; org[2] = ray.org.z;
+		dir[0] = ray.dir.x; dir[1] = ray.dir.y; dir[2] = ray.dir.z;
+		for (int i=0; i!=3; i++)
+			inv_dir[i] = 1.0f/dir[i];
+		a = ray.dir.dot(ray.dir);
+		inv_a = 1.0f/a;
+	}
+};
+
+/**
+ * Slab test of a ray against a box over [0, t_max]
+ * @param  box    The box
+ * @param  cr     The ray data
+ * @param  t_max  The far end of the interval
+ * @param  out_t  Where the ray enters the box
+ * @return        true if the ray hits the box
+ */
+static inline bool hit_box(const AABB& box, const CloudRay& cr, float t_max, float& out_t) {
+	const float lo[3] = {box.lo.x, box.lo.y, box.lo.z}, hi[3] = {box.hi.x, box.hi.y, box.hi.z};
+	float t_near = 0.0, t_far = t_max;
+	for (int i=0; i!=3; i++) {
+		float t0 = (lo[i] - cr.org[i])*cr.inv_dir[i], t1 = (hi[i] - cr.org[i])*cr.inv_dir[i];
+		if (t0 > t1)
+			std::swap(t0, t1);
+		t_near = t0 > t_near? t0: t_near;
+		t_far = t1 < t_far? t1: t_far;
+	}
+	out_t = t_near;
+	return t_near <= t_far;
+}
+
+/**
+ * Intersects a ray with CLOUD_LEAF particles at once. The roots come from
+ * the stable form of the quadratic: the discriminant is computed from the
+ * distance of the center to the ray, which does not cancel for small
+ * particles far from the origin, and the smaller root as c/q, which does
+ * not cancel either. A ray that starts on or inside a particle misses it,
+ * so the shadow ray of a point does not hit its own particle.
+ * @param p        The particles, CLOUD_LEAF of them must be readable
+ * @param cr       The ray data
+ * @param out_near The near root of each particle, -1 if it is missed
+ * @param out_far  The far root of each particle
+ */
+static inline void hit_particles(const Particle *p, const CloudRay& cr, float out_near[CLOUD_LEAF],
+																 float out_far[CLOUD_LEAF]) {
+#ifdef __SSE__
+	__m128 X = _mm_loadu_ps(&p[0].x), Y = _mm_loadu_ps(&p[1].x), Z = _mm_loadu_ps(&p[2].x), R = _mm_loadu_ps(&p[3].x);
+	_MM_TRANSPOSE4_PS(X, Y, Z, R);
+	const __m128 zero = _mm_setzero_ps(), sign = _mm_set1_ps(-0.0f);
+	const __m128 dx = _mm_set1_ps(cr.dir[0]), dy = _mm_set1_ps(cr.dir[1]), dz = _mm_set1_ps(cr.dir[2]);
+	const __m128 a = _mm_set1_ps(cr.a), inv_a = _mm_set1_ps(cr.inv_a);
+	__m128 fx = _mm_sub_ps(_mm_set1_ps(cr.org[0]), X);
+	__m128 fy = _mm_sub_ps(_mm_set1_ps(cr.org[1]), Y);
+	__m128 fz = _mm_sub_ps(_mm_set1_ps(cr.org[2]), Z);
+	__m128 b = _mm_sub_ps(zero, _mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, dx), _mm_mul_ps(fy, dy)), _mm_mul_ps(fz, dz)));
+	__m128 r2 = _mm_mul_ps(R, R);
+	__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)), _mm_mul_ps(fz, fz)), r2);
+	/* l is the vector from the center to the closest point of the ray */
+	__m128 s = _mm_mul_ps(b, inv_a);
+	__m128 lx = _mm_add_ps(fx, _mm_mul_ps(s, dx)), ly = _mm_add_ps(fy, _mm_mul_ps(s, dy)), lz = _mm_add_ps(fz, _mm_mul_ps(s, dz));
+	__m128 l2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+	__m128 disc = _mm_mul_ps(a, _mm_sub_ps(r2, l2));
+	__m128 q = _mm_add_ps(b, _mm_or_ps(_mm_sqrt_ps(_mm_max_ps(disc, zero)), _mm_and_ps(b, sign)));
+	__m128 t0 = _mm_div_ps(c, q), t1 = _mm_mul_ps(q, inv_a);
+	__m128 miss = _mm_or_ps(_mm_cmplt_ps(disc, zero), _mm_cmple_ps(c, _mm_mul_ps(r2, _mm_set1_ps(CLOUD_EPS))));
+	__m128 near = _mm_or_ps(_mm_and_ps(miss, _mm_set1_ps(-1.0f)), _mm_andnot_ps(miss, _mm_min_ps(t0, t1)));
+	_mm_storeu_ps(out_near, near);
+	_mm_storeu_ps(out_far, _mm_max_ps(t0, t1));
+#else
+	for (int k=0; k!=CLOUD_LEAF; k++) {
+		float f[3] = {cr.org[0] - p[k].x, cr.org[1] - p[k].y, cr.org[2] - p[k].z};
+		float b = -(f[0]*cr.dir[0] + f[1]*cr.dir[1] + f[2]*cr.dir[2]), r2 = p[k].r*p[k].r;
+		float c = f[0]*f[0] + f[1]*f[1] + f[2]*f[2] - r2, s = b*cr.inv_a, l2 = 0.0;
+		for (int i=0; i!=3; i++)
+			l2 += (f[i] + s*cr.dir[i])*(f[i] + s*cr.dir[i]);
+		float disc = cr.a*(r2 - l2);
+		float q = b + copysignf(sqrtf(fmaxf(disc, 0.0f)), b), t0 = c/q, t1 = q*cr.inv_a;
+		out_near[k] = disc < 0.0 || c <= CLOUD_EPS*r2? -1.0f: fminf(t0, t1);
+		out_far[k] = fmaxf(t0, t1);
+	}
+#endif
+}
+
+/** Empty constructor, the particles are added with add */
+SphereCloud::SphereCloud() {
+	type = 5;
+	t_idx = -1;
+	depth = 0;
+}
+
+/**
+ * Adds a particle. Its material is the last one added if it is the same,
+ * so a cloud in few colors keeps few materials.
+ * @param x         the x coordinate of the center
+ * @param y         the y coordinate of the center
+ * @param z         the z coordinate of the center
+ * @param r         the radius
+ * @param mtl_color the color of the material
+ * @param t_idx     the texture of the material, -1 if none
+ */
+void SphereCloud::add(float x, float y, float z, float r, MtlColor mtl_color, int t_idx) {
+	if (materials.empty() || materials.back().t_idx != t_idx ||
+			memcmp(&materials.back().mtl_color, &mtl_color, sizeof(MtlColor)) != 0) {
+		if (materials.size() > USHRT_MAX)
+			throw invalid_scene_file();
+		materials.push_back(Surface());
+		materials.back().mtl_color = mtl_color;
+		materials.back().t_idx = t_idx;
+		materials.back().type = 0;
+	}
+	Particle p = {x, y, z, r};
+	particles.push_back(p);
+	mtl_idx.push_back(materials.size()-1);
+}
+
+/**
+ * Builds the tree over the particles and sorts them into its leaves. The
+ * particles are split at the median of the widest axis, rounded to whole
+ * leaves so that only the last leaf of a run is partly empty. The array is
+ * padded with CLOUD_LEAF-1 particles so a leaf can always be read whole.
+ */
+void SphereCloud::build() {
+	nodes.clear();
+	depth = 0;
+	int n = mtl_idx.size();
+	particles.resize(n);
+	if (n == 0)
+		return;
+
+	std::vector<int> order(n);
+	for (int i=0; i!=n; i++)
+		order[i] = i;
+	nodes.reserve(2*(n/CLOUD_LEAF + 1));
+	build_recursive(order, 0, n, 1);
+
+	std::vector<Particle> sorted(n + CLOUD_LEAF-1);
+	std::vector<unsigned short> sorted_idx(n);
+	for (int i=0; i!=n; i++) {
+		sorted[i] = particles[order[i]];
+		sorted_idx[i] = mtl_idx[order[i]];
+	}
+	particles.swap(sorted);
+	mtl_idx.swap(sorted_idx);
+}
+
+/**
+ * Builds the subtree over the particles order[start, end)
+ * @param  order The particles, reordered into the leaves
+ * @param  start The first particle of the node
+ * @param  end   One past the last particle of the node
+ * @param  level The depth of the node
+ * @return       The index of the node
+ */
+int SphereCloud::build_recursive(std::vector<int>& order, int start, int end, int level) {
+	int index = nodes.size();
+	nodes.push_back(CloudNode());
+	depth = std::max(depth, level);
+
+	AABB box, cbox;
+	for (int i=start; i!=end; i++) {
+		const Particle& p = particles[order[i]];
+		box.grow(AABB(Vec3(p.x-p.r, p.y-p.r, p.z-p.r), Vec3(p.x+p.r, p.y+p.r, p.z+p.r)));
+		cbox.grow(Vec3(p.x, p.y, p.z));
+	}
+	nodes[index].box = box;
+
+	int n = end - start;
+	if (n <= CLOUD_LEAF) {
+		nodes[index].offset = start;
+		nodes[index].count = n;
+		return index;
+	}
+
+	Vec3 ext = cbox.hi - cbox.lo;
+	int axis = (ext.x > ext.y && ext.x > ext.z)? 0: (ext.y > ext.z? 1: 2);
+	int mid = start + (n/2 + CLOUD_LEAF-1)/CLOUD_LEAF*CLOUD_LEAF;
+	auto coord = [&](int i) { const Particle& p = particles[i]; return axis==0? p.x: (axis==1? p.y: p.z); };
+	std::nth_element(order.begin()+start, order.begin()+mid, order.begin()+end, [&](int a, int b) {
+		return coord(a) < coord(b);
+	});
+
+	build_recursive(order, start, mid, level+1);
+	int right = build_recursive(order, mid, end, level+1);
+	nodes[index].offset = right;
+	nodes[index].count = 0;
+	return index;
+}
+
+/**
+ * Prints statistics about the cloud
+ */
+void SphereCloud::print() {
+	size_t bytes = particles.size()*sizeof(Particle) + mtl_idx.size()*sizeof(unsigned short) +
+		nodes.size()*sizeof(CloudNode);
+	printf("SphereCloud:= particles: %zu materials: %zu nodes: %zu depth: %i (%zu bytes)\n", mtl_idx.size(),
+		materials.size(), nodes.size(), depth, bytes);
+}
+
+/**
+ * Finds the particle whose near root is the closest one in front of the
+ * origin, visiting the nearer child of each node first. Ties go to the
+ * first particle in the tree.
+ * @param  r       The ray
+ * @param  out_hit The record of the hit, with the particle as index
+ * @return         The t of the closest particle, or -1 if none is hit
+ */
+float SphereCloud::hit(Ray r, Hit& out_hit) {
+	out_hit.surface = out_hit.prim = this;
+	out_hit.t = out_hit.t_max = -1.0;
+	CloudRay cr(r);
+	float t_root;
+	if (nodes.empty() || !hit_box(nodes[0].box, cr, INFINITY, t_root))
+		return -1.0;
+
+	int stack[CLOUD_STACK], sp = 0, best = -1;
+	float entry[CLOUD_STACK], best_t = INFINITY, best_far = INFINITY;
+	stack[sp] = 0; entry[sp++] = t_root;
+
+	while (sp > 0) {
+		--sp;
+		if (entry[sp] > best_t)
+			continue;
+		int node = stack[sp];
+		const CloudNode& n = nodes[node];
+		if (n.count > 0) {
+			float near[CLOUD_LEAF], far[CLOUD_LEAF];
+			hit_particles(&particles[n.offset], cr, near, far);
+			for (int k=0; k!=n.count; k++)
+				if (near[k] > 0.0 && (near[k] < best_t || (near[k] == best_t && n.offset+k < best))) {
+					best_t = near[k];
+					best_far = far[k];
+					best = n.offset+k;
+				}
+			continue;
+		}
+
+		/* push the farther child first so the nearer one is popped first */
+		int left = node+1, right = n.offset;
+		float t_left, t_right;
+		bool hit_left = hit_box(nodes[left].box, cr, best_t, t_left);
+		bool hit_right = hit_box(nodes[right].box, cr, best_t, t_right);
+		if (hit_left && hit_right && t_right < t_left) {
+			std::swap(left, right);
+			std::swap(t_left, t_right);
+		}
+		if (hit_right) {
+			stack[sp] = right;
+			entry[sp++] = t_right;
+		}
+		if (hit_left) {
+			stack[sp] = left;
+			entry[sp++] = t_left;
+		}
+	}
+
+	if (best == -1)
+		return -1.0;
+	out_hit.prim = &materials[mtl_idx[best]];
+	out_hit.index = best;
+	out_hit.t_max = best_far;
+	return out_hit.t = best_t;
+}
+
+/**
+ * Returns the normal of the particle hit
+ * @param  hit       The record of the hit, for the particle
+ * @param  intersect The point of intersection
+ * @return           The unit normal vector N
+ */
+Vec3 SphereCloud::get_normal(const Hit& hit, Vec3 intersect) {
+	const Particle& p = particles[hit.index];
+	return (intersect - Vec3(p.x, p.y, p.z)).normalize();
+}
+
+/**
+ * Returns the box enclosing all particles, empty if there are none
+ * @return The bounding box
+ */
+AABB SphereCloud::get_bounds() {
+	return nodes.empty()? AABB(): nodes[0].box;
+}
+
+/**
+ * Get the u texture coordinate at point p, as for a sphere
+ * @param  hit The record of the hit, for the particle
+ * @param  p   The point on the particle
+ * @return     The u texture coordinate
+ */
+float SphereCloud::get_u(const Hit& hit, Vec3& p) {
+	const Particle& c = particles[hit.index];
+	float theta = std::atan2(p.y-c.y, p.x-c.x);
+	assert((!std::isnan(theta)));
+	if (theta < 0)
+		theta += 2*M_PI;
+	return theta/(2*M_PI);
+}
+
+/**
+ * Get the v texture coordinate at point p, as for a sphere
+ * @param  hit The record of the hit, for the particle
+ * @param  p   The point on the particle
+ * @return     The v texture coordinate
+ */
+float SphereCloud::get_v(const Hit& hit, Vec3& p) {
+	const Particle& c = particles[hit.index];
+	float ratio = (p.z-c.z)/c.r;
+	float phi = std::acos(ratio>1.0? 1.0: (ratio<-1.0? -1.0: ratio));
+	assert((!std::isnan(phi)));
+	return phi/M_PI;
+}
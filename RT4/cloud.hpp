@@ -0,0 +1,60 @@
+#ifndef _CLOUD_HPP
+#define _CLOUD_HPP
+
+#include <vector>
+
+#include "geometry.hpp"
+#include "surfaces.hpp"
+
+#define CLOUD_LEAF 4	// particles in a leaf of the cloud tree, intersected together
+
+/** A particle of a SphereCloud: its center and radius, 16 bytes */
+struct Particle {
+	float x, y, z, r;
+};
+
+/**
+ * A node of the tree of a SphereCloud, laid out like BVHNode: inner nodes
+ * have count == 0, their first child right after them and the second at
+ * offset. Leaves hold the particles [offset, offset+count).
+ */
+struct CloudNode {
+	AABB box;
+	int offset;
+	int count;
+};
+
+/**
+ * SphereCloud is derived from a surface. It holds many small spheres, the
+ * particles of a particle or molecule scene, without a Surface for each:
+ * a particle is 16 bytes and its material an index into materials, kept
+ * in a separate array. The cloud has a tree of its own whose leaves hold
+ * CLOUD_LEAF particles, which are intersected together with SSE.
+ * hit gives the particle as the index of the Hit and its material as the
+ * prim, where the shading calls find its mtl_color and t_idx. Like a
+ * sphere, a particle is hit at its near root only, so rays that start on
+ * or inside it pass through. Particles thus shadow each other but never
+ * themselves.
+ * 	add:	adds a particle with the given material
+ * 	build:	builds the tree, after the last add
+ */
+class SphereCloud : public Surface {
+	std::vector<Particle> particles;
+	std::vector<unsigned short> mtl_idx;
+	std::vector<Surface> materials; // the mtl_color and t_idx of each material
+	std::vector<CloudNode> nodes;
+	int depth;
+	int build_recursive(std::vector<int>& order, int start, int end, int level);
+public:
+	SphereCloud();
+	void add(float x, float y, float z, float r, MtlColor mtl_color, int t_idx);
+	void build();
+	void print();
+	float hit(Ray r, Hit& out_hit);
+	Vec3 get_normal(const Hit& hit, Vec3 intersect);
+	AABB get_bounds();
+	float get_u(const Hit& hit, Vec3& p);
+	float get_v(const Hit& hit, Vec3& p);
+};
+
+#endif
@@ -0,0 +1,313 @@
+#include "farm.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "allexceptions.hpp"
+
+#define MSG_JOB 1		// coordinator to worker: a FarmJob
+#define MSG_RESULT 2		// worker to coordinator: the result of its job
+#define MSG_QUIT 3		// coordinator to worker: there are no more jobs
+#define FARM_POLL_MS 200	// how often the coordinator looks at its children while waiting
+
+/** The start of every message */
+struct MsgHeader {
+	unsigned type, size;
+};
+
+/**
+ * Writes the whole buffer to the socket
+ * @param  fd   The socket
+ * @param  data The buffer
+ * @param  size Its size in bytes
+ * @return      false if the other end is gone
+ */
+static bool write_all(int fd, const void *data, size_t size) {
+	const char *p = (const char*) data;
+	while (size > 0) {
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n; size -= n;
+	}
+	return true;
+}
+
+/**
+ * Reads exactly size bytes from the socket
+ * @param  fd   The socket
+ * @param  data The buffer
+ * @param  size The number of bytes
+ * @return      false if the other end is gone
+ */
+static bool read_all(int fd, void *data, size_t size) {
+	char *p = (char*) data;
+	while (size > 0) {
+		ssize_t n = recv(fd, p, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n; size -= n;
+	}
+	return true;
+}
+
+/**
+ * Sends a message
+ * @param  fd   The socket
+ * @param  type MSG_JOB, MSG_RESULT or MSG_QUIT
+ * @param  data The payload
+ * @param  size The size of the payload
+ * @return      false if the other end is gone
+ */
+static bool send_msg(int fd, unsigned type, const void *data, size_t size) {
+	MsgHeader header = {type, (unsigned) size};
+	return write_all(fd, &header, sizeof(header)) && (size == 0 || write_all(fd, data, size));
+}
+
+/**
+ * Receives a message
+ * @param  fd       The socket
+ * @param  out_type The type of the message
+ * @param  out_data The payload
+ * @return          false if the other end is gone
+ */
+static bool recv_msg(int fd, unsigned& out_type, std::vector<char>& out_data) {
+	MsgHeader header;
+	if (!read_all(fd, &header, sizeof(header)))
+		return false;
+	out_type = header.type;
+	out_data.resize(header.size);
+	return header.size == 0 || read_all(fd, out_data.data(), header.size);
+}
+
+/**
+ * The address of a UNIX domain socket
+ * @param  path The path of the socket
+ * @return      The address
+ */
+static sockaddr_un socket_address(const std::string& path) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw farm_error("the socket path is too long: " + path);
+	strcpy(addr.sun_path, path.c_str());
+	return addr;
+}
+
+/**************************************/
+/**************** Farm ****************/
+/**************************************/
+
+/**
+ * @constructor
+ * Listens on a UNIX domain socket at path, which is replaced if it exists.
+ * @param path The path of the socket
+ */
+Farm::Farm(std::string path) : path(path) {
+	sockaddr_un addr = socket_address(path);
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0)
+		throw farm_error(std::string("socket: ") + strerror(errno));
+	unlink(path.c_str());
+	if (bind(listener, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+		std::string err = strerror(errno);
+		close(listener);
+		throw farm_error(path + ": " + err);
+	}
+}
+
+/** Stops the workers and removes the socket */
+Farm::~Farm() {
+	stop();
+}
+
+/**
+ * Starts worker processes. Their output goes to /dev/null, the output of
+ * the coordinator is enough.
+ * @param count The number of workers
+ * @param args  The command line of a worker, starting with the program
+ */
+void Farm::spawn(int count, const std::vector<std::string>& args) {
+	std::vector<char*> argv;
+	for (const std::string& arg : args)
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(NULL);
+
+	fflush(stdout);
+	for (int i=0; i!=count; i++) {
+		pid_t pid = fork();
+		if (pid < 0)
+			throw farm_error(std::string("fork: ") + strerror(errno));
+		if (pid == 0) {
+			int null = open("/dev/null", O_WRONLY);
+			if (null >= 0)
+				dup2(null, STDOUT_FILENO);
+			execv(argv[0], argv.data());
+			perror(argv[0]);
+			_exit(127);
+		}
+		children.push_back(pid);
+	}
+}
+
+/**
+ * Reaps the spawned workers that exited
+ * @return The number of spawned workers still running
+ */
+int Farm::children_alive() {
+	for (size_t i=0; i<children.size(); ) {
+		if (waitpid(children[i], NULL, WNOHANG) == children[i])
+			children.erase(children.begin()+i);
+		else
+			i++;
+	}
+	return children.size();
+}
+
+/**
+ * Hands the jobs out to the workers, one job per worker at a time, and
+ * calls done with the result of each job as it comes back. New workers
+ * are taken on at any time. The job of a worker that dies, or whose
+ * result done rejects, goes back to the front of the queue. Returns when
+ * every job is done, or when no worker is connected and no spawned worker
+ * is left to connect.
+ * @param  jobs The jobs
+ * @param  done Called with each job and its result, returns false if the
+ *              result is not valid
+ * @return      The jobs that were not done
+ */
+std::vector<FarmJob> Farm::run(const std::vector<FarmJob>& jobs,
+															 const std::function<bool(const FarmJob&, const std::vector<char>&)>& done) {
+	std::deque<FarmJob> pending(jobs.begin(), jobs.end());
+	std::map<int, FarmJob> busy; // the job of each worker that has one
+	std::vector<char> data;
+
+	while (!pending.empty() || !busy.empty()) {
+		std::vector<int> lost;
+		for (int fd : workers)
+			if (!busy.count(fd) && !pending.empty()) {
+				if (send_msg(fd, MSG_JOB, &pending.front(), sizeof(FarmJob))) {
+					busy[fd] = pending.front();
+					pending.pop_front();
+				}
+				else
+					lost.push_back(fd);
+			}
+
+		if (lost.empty()) {
+			if (workers.empty() && children_alive() == 0)
+				break;
+
+			std::vector<pollfd> fds(1);
+			fds[0].fd = listener; fds[0].events = POLLIN;
+			for (int fd : workers) {
+				pollfd p = {fd, POLLIN, 0};
+				fds.push_back(p);
+			}
+			if (poll(fds.data(), fds.size(), FARM_POLL_MS) < 0 && errno != EINTR)
+				throw farm_error(std::string("poll: ") + strerror(errno));
+
+			for (size_t i=1; i!=fds.size(); i++) {
+				if (!fds[i].revents)
+					continue;
+				int fd = fds[i].fd;
+				unsigned type;
+				if (!recv_msg(fd, type, data) || type != MSG_RESULT || !busy.count(fd) || !done(busy[fd], data)) {
+					lost.push_back(fd);
+					continue;
+				}
+				busy.erase(fd);
+			}
+			if (fds[0].revents & POLLIN) {
+				int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+				if (fd >= 0)
+					workers.push_back(fd);
+			}
+		}
+
+		/* the jobs of the lost workers go to the others */
+		for (int fd : lost) {
+			if (busy.count(fd)) {
+				printf("Farm: lost a worker, its bands %i-%i go back to the queue\n", busy[fd].first, busy[fd].last-1);
+				pending.push_front(busy[fd]);
+				busy.erase(fd);
+			}
+			close(fd);
+			for (size_t i=0; i!=workers.size(); i++)
+				if (workers[i] == fd) {
+					workers.erase(workers.begin()+i);
+					break;
+				}
+		}
+	}
+
+	return std::vector<FarmJob>(pending.begin(), pending.end());
+}
+
+/**
+ * Tells the workers to quit, removes the socket so no other worker
+ * connects and waits for the spawned workers to exit. Spawned workers
+ * that did not connect yet fail to and exit.
+ */
+void Farm::stop() {
+	for (int fd : workers) {
+		send_msg(fd, MSG_QUIT, NULL, 0);
+		close(fd);
+	}
+	workers.clear();
+	if (listener >= 0) {
+		close(listener);
+		unlink(path.c_str());
+		listener = -1;
+	}
+	for (pid_t pid : children)
+		waitpid(pid, NULL, 0);
+	children.clear();
+}
+
+/**************************************/
+/*************** Worker ***************/
+/**************************************/
+
+/**
+ * Runs a worker until the coordinator says to quit or goes away
+ * @param path   The socket of the coordinator
+ * @param render Renders a job and returns the result to send back
+ */
+void farm_worker(std::string path, const std::function<std::vector<char>(const FarmJob&)>& render) {
+	sockaddr_un addr = socket_address(path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw farm_error(std::string("socket: ") + strerror(errno));
+	if (connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+		std::string err = strerror(errno);
+		close(fd);
+		throw farm_error(path + ": " + err);
+	}
+
+	unsigned type;
+	std::vector<char> data;
+	while (recv_msg(fd, type, data) && type == MSG_JOB && data.size() == sizeof(FarmJob)) {
+		FarmJob job;
+		memcpy(&job, data.data(), sizeof(job));
+		std::vector<char> result = render(job);
+		if (!send_msg(fd, MSG_RESULT, result.data(), result.size()))
+			break;
+	}
+	close(fd);
+}
@@ -0,0 +1,52 @@
+#ifndef _FARM_HPP
+#define _FARM_HPP
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+/**
+ * A job for a worker: render the bands [first, last) of a frame. A band
+ * is FARM_BAND rows of the image, see main.cpp.
+ */
+struct FarmJob {
+	int frame, first, last;
+};
+
+/**
+ * The coordinator of a render farm. Workers are processes that load the
+ * same scene with the same options and connect to a socket; the farm
+ * hands each of them one job at a time and collects the results. A
+ * worker that dies or closes its connection loses its job, which is given
+ * to the next free worker.
+ * The messages are a type and a size followed by the payload, so the same
+ * protocol can run over TCP; only the UNIX domain socket is used for now.
+ * 	spawn:	starts worker processes on this machine
+ * 	run:	renders the jobs of a frame, returns the jobs no worker was left
+ * 		to render
+ * 	stop:	tells the workers to quit and waits for the ones it spawned
+ */
+class Farm {
+	std::string path;
+	int listener;
+	std::vector<int> workers;
+	std::vector<pid_t> children;
+	int children_alive();
+public:
+	Farm(std::string path);
+	~Farm();
+	void spawn(int count, const std::vector<std::string>& args);
+	std::vector<FarmJob> run(const std::vector<FarmJob>& jobs,
+													 const std::function<bool(const FarmJob&, const std::vector<char>&)>& done);
+	void stop();
+};
+
+/**
+ * Runs a worker: connects to the coordinator at path and renders jobs with
+ * render, which returns the result to send back, until it is told to quit.
+ */
+void farm_worker(std::string path, const std::function<std::vector<char>(const FarmJob&)>& render);
+
+#endif
@@ -168,3 +168,180 @@ Vec3 operator*(Vec3 one, Vec3 two) {
 	return Vec3(one.x*two.x, one.y*two.y, one.z*two.z);
 }
 
+
+
+/***********************************/
+/************* AABB ****************/
+/***********************************/
+
+/** Empty constructor. The box starts out empty (lo > hi). */
+AABB::AABB() {
+	lo = Vec3(INFINITY, INFINITY, INFINITY);
+	hi = Vec3(-INFINITY, -INFINITY, -INFINITY);
+}
+
+/**
+ * @constructor
+ * @param lo 	the corner with the smallest coordinates
+ * @param hi 	the corner with the largest coordinates
+ */
+AABB::AABB(Vec3 lo, Vec3 hi) {
+	this->lo = lo; this->hi = hi;
+}
+
+/**
+ * Enlarge the box so that it contains the point p
+ * @param p The point to enclose
+ */
+void AABB::grow(const Vec3& p) {
+	lo = Vec3(fminf(lo.x, p.x), fminf(lo.y, p.y), fminf(lo.z, p.z));
+	hi = Vec3(fmaxf(hi.x, p.x), fmaxf(hi.y, p.y), fmaxf(hi.z, p.z));
+}
+
+/**
+ * Enlarge the box so that it contains the other box. Growing by an empty
+ * box leaves the box unchanged.
+ * @param box The box to enclose
+ */
+void AABB::grow(const AABB& box) {
+	lo = Vec3(fminf(lo.x, box.lo.x), fminf(lo.y, box.lo.y), fminf(lo.z, box.lo.z));
+	hi = Vec3(fmaxf(hi.x, box.hi.x), fmaxf(hi.y, box.hi.y), fmaxf(hi.z, box.hi.z));
+}
+
+/**
+ * Surface area of the box. An empty box has zero area.
+ * @return the surface area
+ */
+float AABB::area() const {
+	Vec3 d = hi - lo;
+	if (d.x < 0.0 || d.y < 0.0 || d.z < 0.0)
+		return 0.0;
+	return 2.0*(d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
+/**
+ * The center of the box
+ * @return the centroid
+ */
+Vec3 AABB::centroid() const {
+	return .5*(lo + hi);
+}
+
+void AABB::print() {
+	printf("AABB:= lo(%.3f, %.3f, %.3f) hi(%.3f, %.3f, %.3f)\n", lo.x, lo.y, lo.z, hi.x, hi.y, hi.z);
+}
+
+
+/***********************************/
+/*********** Transform *************/
+/***********************************/
+
+/** Empty constructor. The identity transform. */
+Transform::Transform() {
+	for (int i=0; i!=3; i++)
+		for (int j=0; j!=3; j++)
+			m[i][j] = i==j? 1.0: 0.0;
+	d = Vec3(0.0, 0.0, 0.0);
+}
+
+/**
+ * A translation
+ * @param  d The offset
+ * @return   The transform
+ */
+Transform Transform::translate(Vec3 d) {
+	Transform t;
+	t.d = d;
+	return t;
+}
+
+/**
+ * A scaling along the axes
+ * @param  s The scale factors for x, y and z
+ * @return   The transform
+ */
+Transform Transform::scale(Vec3 s) {
+	Transform t;
+	t.m[0][0] = s.x; t.m[1][1] = s.y; t.m[2][2] = s.z;
+	return t;
+}
+
+/**
+ * A rotation about one of the coordinate axes
+ * @param  axis    0 for x, 1 for y, 2 for z
+ * @param  degrees The angle, counter-clockwise looking down the axis
+ * @return         The transform
+ */
+Transform Transform::rotate(int axis, Angle degrees) {
+	Transform t;
+	float rad = degrees*M_PI/180.0, c = cos(rad), s = sin(rad);
+	int i = (axis+1)%3, j = (axis+2)%3;
+	t.m[i][i] = c; t.m[i][j] = -s;
+	t.m[j][i] = s; t.m[j][j] = c;
+	return t;
+}
+
+/**
+ * Transform a point
+ * @param  p The point
+ * @return   m*p + d
+ */
+Vec3 Transform::point(const Vec3& p) const {
+	return vector(p) + d;
+}
+
+/**
+ * Transform a direction. The translation does not apply.
+ * @param  v The direction
+ * @return   m*v
+ */
+Vec3 Transform::vector(const Vec3& v) const {
+	return Vec3(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+							m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+							m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+}
+
+/**
+ * Multiply by the transpose of m. Calling this on the inverse of a
+ * transform maps normals the same way the transform maps points.
+ * @param  v The vector
+ * @return   transpose(m)*v
+ */
+Vec3 Transform::transpose_vector(const Vec3& v) const {
+	return Vec3(m[0][0]*v.x + m[1][0]*v.y + m[2][0]*v.z,
+							m[0][1]*v.x + m[1][1]*v.y + m[2][1]*v.z,
+							m[0][2]*v.x + m[1][2]*v.y + m[2][2]*v.z);
+}
+
+/**
+ * The inverse transform. Assumes m is not singular.
+ * @return The inverse
+ */
+Transform Transform::inverse() const {
+	Transform t;
+	float det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+						- m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+						+ m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+	for (int i=0; i!=3; i++)
+		for (int j=0; j!=3; j++) {
+			/* cofactor of m[j][i] */
+			int r0 = (j+1)%3, r1 = (j+2)%3, c0 = (i+1)%3, c1 = (i+2)%3;
+			t.m[i][j] = (m[r0][c0]*m[r1][c1] - m[r0][c1]*m[r1][c0])/det;
+		}
+	t.d = -1.0*t.vector(d);
+	return t;
+}
+
+void Transform::print() {
+	printf("Transform:= [%.3f %.3f %.3f | %.3f] [%.3f %.3f %.3f | %.3f] [%.3f %.3f %.3f | %.3f]\n",
+		m[0][0], m[0][1], m[0][2], d.x, m[1][0], m[1][1], m[1][2], d.y, m[2][0], m[2][1], m[2][2], d.z);
+}
+
+Transform operator*(const Transform& one, const Transform& two) {
+	Transform t;
+	for (int i=0; i!=3; i++)
+		for (int j=0; j!=3; j++)
+			t.m[i][j] = one.m[i][0]*two.m[0][j] + one.m[i][1]*two.m[1][j] + one.m[i][2]*two.m[2][j];
+	t.d = one.point(two.d);
+	return t;
+}
@@ -60,9 +60,54 @@ public:
 	friend Vec3 operator/(Vec3 vec, float f);
 };
 
+/**
+ * AABB is an axis-aligned bounding box given by its lo and hi corners.
+ * A default constructed box is empty and grows to fit points or boxes.
+ * 	grow:	enlarge the box to enclose a point or another box
+ * 	area:	surface area of the box, used by the SAH
+ * 	centroid:	center point of the box
+ */
+class AABB {
+public:
+	Vec3 lo, hi;
+	AABB();
+	AABB(Vec3 lo, Vec3 hi);
+	void grow(const Vec3& p);
+	void grow(const AABB& box);
+	float area() const;
+	Vec3 centroid() const;
+	void print();
+};
+
 /** Angle is just a float */
 typedef float Angle;
 
+/**
+ * Affine transform p' = m*p + d, with m a 3x3 matrix and d a translation.
+ * The default transform is the identity. Transforms compose with *, the
+ * right hand side is applied first.
+ * 	point:	transform a point
+ * 	vector:	transform a direction (no translation)
+ * 	transpose_vector:	multiply by the transpose of m. Normals are
+ * 		transformed this way by the inverse transform.
+ * 	inverse:	the inverse transform
+ */
+class Transform {
+public:
+	float m[3][3];
+	Vec3 d;
+	Transform();
+	static Transform translate(Vec3 d);
+	static Transform scale(Vec3 s);
+	static Transform rotate(int axis, Angle degrees);
+	Vec3 point(const Vec3& p) const;
+	Vec3 vector(const Vec3& v) const;
+	Vec3 transpose_vector(const Vec3& v) const;
+	Transform inverse() const;
+	void print();
+	friend Transform operator*(const Transform& one, const Transform& two);
+};
+
 
 /** Ray is a functor with origin org and directional vector dir.
  * To evaluate the ray for some t in ray(t) = org + t*dir, 
@@ -0,0 +1,421 @@
+#include "grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#define GRID_DENSITY 2.0		// cells per surface of a one level grid
+#define GRID_TOP_DENSITY 0.25	// cells per surface of the top of a two level grid
+#define GRID_CHILD_MIN 8		// cells with more surfaces get a finer grid
+#define GRID_MAX_RES 256		// cells along one axis at most
+#define GRID_BOX_EPS 1e-4		// padding so flat boxes are not missed by rounding
+
+/** Get the axis component of a vector, 0 is x, 1 is y, 2 is z. */
+static inline float axis_of(const Vec3& v, int axis) {
+	return axis==0? v.x: (axis==1? v.y: v.z);
+}
+
+/**
+ * Per-ray data for traversal: the ray, and its origin, direction and
+ * inverse direction as arrays.
+ */
+struct GridRay {
+	const Ray& ray;
+	float org[3], dir[3], inv_dir[3];
+	GridRay(const Ray& ray) : ray(ray) {
+		org[0] = ray.org.x; org[1] = ray.org.y; org[2] = ray.org.z;
+		dir[0] = ray.dir.x; dir[1] = ray.dir.y; dir[2] = ray.dir.z;
+		for (int axis=0; axis!=3; axis++)
+			inv_dir[axis] = 1.0f/dir[axis];
+	}
+};
+
+/** The closest hit found so far and the scene index of its surface */
+struct GridHit {
+	Hit hit;
+	int id;
+	GridHit() : id(-1) {}
+};
+
+/**
+ * @constructor
+ * @param levels 1 for a uniform grid, 2 for a two level grid
+ */
+Grid::Grid(int levels) {
+	this->levels = levels;
+	res[0] = res[1] = res[2] = 0;
+	cell[0] = cell[1] = cell[2] = 1.0;
+}
+
+/** The grid owns its child grids */
+Grid::~Grid() {
+	clear();
+}
+
+/** Frees the child grids and empties the cells */
+void Grid::clear() {
+	for (Grid *child : children)
+		delete child;
+	children.clear();
+	cell_start.clear();
+	items.clear();
+	res[0] = res[1] = res[2] = 0;
+}
+
+/**
+ * Builds the grid over the surfaces. The surfaces are not copied, so they
+ * must outlive the grid.
+ * @param surfaces The surfaces of the scene
+ */
+void Grid::build(const std::vector<Surface*>& surfaces) {
+	clear();
+	prims = surfaces;
+	if (prims.empty())
+		return;
+
+	std::vector<AABB> boxes(prims.size());
+	std::vector<int> ids(prims.size());
+	AABB bounds;
+	Vec3 pad(GRID_BOX_EPS, GRID_BOX_EPS, GRID_BOX_EPS);
+	for (size_t i=0; i!=prims.size(); i++) {
+		AABB b = prims[i]->get_bounds();
+		boxes[i] = AABB(b.lo - pad, b.hi + pad);
+		bounds.grow(boxes[i]);
+		ids[i] = i;
+	}
+	build_cells(boxes, ids, bounds, levels > 1? GRID_TOP_DENSITY: GRID_DENSITY, levels);
+}
+
+/**
+ * Fills the cells of this grid with the surfaces ids. The resolution is
+ * chosen so there are about density cells per surface, with cubic cells.
+ * With more than one level, crowded cells are handed to a finer grid.
+ * @param boxes   The padded boxes of all surfaces
+ * @param ids     The surfaces to put in this grid
+ * @param bounds  The box of this grid
+ * @param density Cells per surface
+ * @param levels  Levels of grids from this one down
+ */
+void Grid::build_cells(const std::vector<AABB>& boxes, const std::vector<int>& ids, const AABB& bounds,
+											 float density, int levels) {
+	box = bounds;
+	float ext[3], longest = 0.0;
+	for (int axis=0; axis!=3; axis++) {
+		ext[axis] = axis_of(box.hi, axis) - axis_of(box.lo, axis);
+		longest = std::max(longest, ext[axis]);
+	}
+	/* flat scenes get some thickness so the volume is not zero */
+	float volume = 1.0;
+	for (int axis=0; axis!=3; axis++)
+		volume *= std::max(ext[axis], 1e-3f*longest);
+	float k = longest > 0.0? cbrtf(density*ids.size()/volume): 0.0;
+	for (int axis=0; axis!=3; axis++) {
+		res[axis] = std::min(std::max((int) roundf(ext[axis]*k), 1), GRID_MAX_RES);
+		cell[axis] = ext[axis] > 0.0? ext[axis]/res[axis]: 1.0;
+	}
+
+	/* count the surfaces of every cell, then fill them */
+	int ncells = res[0]*res[1]*res[2];
+	std::vector<int> range(6*ids.size());
+	cell_start.assign(ncells+1, 0);
+	for (size_t i=0; i!=ids.size(); i++) {
+		const AABB& b = boxes[ids[i]];
+		int *r = &range[6*i];
+		for (int axis=0; axis!=3; axis++) {
+			float lo = axis_of(box.lo, axis);
+			r[axis] = std::min(std::max((int) floorf((axis_of(b.lo, axis) - lo)/cell[axis]), 0), res[axis]-1);
+			r[3+axis] = std::min(std::max((int) floorf((axis_of(b.hi, axis) - lo)/cell[axis]), 0), res[axis]-1);
+		}
+		for (int z=r[2]; z<=r[5]; z++)
+			for (int y=r[1]; y<=r[4]; y++)
+				for (int x=r[0]; x<=r[3]; x++)
+					cell_start[(z*res[1] + y)*res[0] + x + 1]++;
+	}
+	for (int c=0; c!=ncells; c++)
+		cell_start[c+1] += cell_start[c];
+	items.resize(cell_start[ncells]);
+	std::vector<int> fill(cell_start.begin(), cell_start.end()-1);
+	for (size_t i=0; i!=ids.size(); i++) {
+		int *r = &range[6*i];
+		for (int z=r[2]; z<=r[5]; z++)
+			for (int y=r[1]; y<=r[4]; y++)
+				for (int x=r[0]; x<=r[3]; x++)
+					items[fill[(z*res[1] + y)*res[0] + x]++] = ids[i];
+	}
+	if (levels <= 1)
+		return;
+
+	/* crowded cells get a grid of their own, over the part of the cell their surfaces cover */
+	children.assign(ncells, NULL);
+	std::vector<int> kept;
+	std::vector<int> kept_start(1, 0);
+	for (int c=0; c!=ncells; c++) {
+		int n = cell_start[c+1] - cell_start[c];
+		if (n > GRID_CHILD_MIN) {
+			std::vector<int> child_ids(items.begin()+cell_start[c], items.begin()+cell_start[c+1]);
+			int x = c%res[0], y = (c/res[0])%res[1], z = c/(res[0]*res[1]);
+			Vec3 lo = box.lo + Vec3(x*cell[0], y*cell[1], z*cell[2]);
+			AABB cover;
+			for (int id : child_ids)
+				cover.grow(boxes[id]);
+			cover.lo = Vec3(std::max(cover.lo.x, lo.x), std::max(cover.lo.y, lo.y), std::max(cover.lo.z, lo.z));
+			cover.hi = Vec3(std::min(cover.hi.x, lo.x+cell[0]), std::min(cover.hi.y, lo.y+cell[1]),
+											std::min(cover.hi.z, lo.z+cell[2]));
+			children[c] = new Grid(levels-1);
+			children[c]->build_cells(boxes, child_ids, cover, GRID_DENSITY, levels-1);
+		}
+		else
+			kept.insert(kept.end(), items.begin()+cell_start[c], items.begin()+cell_start[c+1]);
+		kept_start.push_back(kept.size());
+	}
+	items.swap(kept);
+	cell_start.swap(kept_start);
+}
+
+/**
+ * Clips the interval [t_begin, t_end] of the ray to the box of the grid
+ * @param  r       The ray data
+ * @param  t_begin The start of the interval
+ * @param  t_end   The end of the interval
+ * @param  out_t0  Where the ray enters the box
+ * @param  out_t1  Where the ray leaves the box
+ * @return         false if the ray misses the box in the interval
+ */
+bool Grid::clip(const GridRay& r, float t_begin, float t_end, float& out_t0, float& out_t1) {
+	out_t0 = t_begin; out_t1 = t_end;
+	for (int axis=0; axis!=3; axis++) {
+		float lo = axis_of(box.lo, axis), hi = axis_of(box.hi, axis);
+		if (std::isnan(r.dir[axis]))
+			return false;
+		if (r.dir[axis] == 0.0) {
+			if (r.org[axis] < lo || r.org[axis] > hi)
+				return false;
+			continue;
+		}
+		float ta = (lo - r.org[axis])*r.inv_dir[axis], tb = (hi - r.org[axis])*r.inv_dir[axis];
+		out_t0 = std::max(out_t0, std::min(ta, tb));
+		out_t1 = std::min(out_t1, std::max(ta, tb));
+	}
+	return out_t0 <= out_t1;
+}
+
+/**
+ * Sets up the 3D-DDA: the cell where the ray enters, the step along each
+ * axis, the t at which the next cell boundary is crossed on each axis and
+ * the t between two boundaries.
+ * @param r       The ray data
+ * @param t0      Where the ray enters the grid
+ * @param c       The cell
+ * @param step    The step, 1, -1 or 0 if the ray is parallel to the axis
+ * @param t_next  The t of the next boundary
+ * @param t_delta The t between boundaries
+ */
+void Grid::dda_setup(const GridRay& r, float t0, int c[3], int step[3], float t_next[3], float t_delta[3]) {
+	for (int axis=0; axis!=3; axis++) {
+		float lo = axis_of(box.lo, axis), p = r.org[axis] + t0*r.dir[axis];
+		c[axis] = std::min(std::max((int) floorf((p - lo)/cell[axis]), 0), res[axis]-1);
+		if (r.dir[axis] == 0.0) {
+			step[axis] = 0; t_next[axis] = INFINITY; t_delta[axis] = INFINITY;
+			continue;
+		}
+		step[axis] = r.dir[axis] > 0.0? 1: -1;
+		float plane = lo + (c[axis] + (step[axis] > 0))*cell[axis];
+		t_next[axis] = (plane - r.org[axis])*r.inv_dir[axis];
+		t_delta[axis] = cell[axis]*fabsf(r.inv_dir[axis]);
+	}
+}
+
+/**
+ * Walks the cells of the grid hit by the ray in [t_begin, t_end], front
+ * to back, keeping the closest surface in best. Stops as soon as the best
+ * hit is inside the current cell, as no later cell can hold a closer one.
+ * @param  prims   The surfaces of the scene
+ * @param  r       The ray data
+ * @param  t_begin The start of the interval
+ * @param  t_end   The end of the interval
+ * @param  best    The closest hit so far
+ * @return         true if best is final
+ */
+bool Grid::closest_in(const std::vector<Surface*>& prims, const GridRay& r, float t_begin, float t_end,
+											GridHit& best) {
+	float t0, t1;
+	if (!clip(r, t_begin, t_end, t0, t1))
+		return false;
+	int c[3], step[3];
+	float t_next[3], t_delta[3];
+	dda_setup(r, t0, c, step, t_next, t_delta);
+
+	float t_enter = t0;
+	for (;;) {
+		int axis = t_next[0] < t_next[1]? (t_next[0] < t_next[2]? 0: 2): (t_next[1] < t_next[2]? 1: 2);
+		float t_exit = std::min(t_next[axis], t1);
+		int index = (c[2]*res[1] + c[1])*res[0] + c[0];
+
+		if (!children.empty() && children[index]) {
+			if (children[index]->closest_in(prims, r, t_enter, t_exit, best))
+				return true;
+		}
+		else
+			for (int i=cell_start[index]; i!=cell_start[index+1]; i++) {
+				int id = items[i];
+				Hit h;
+				float t = prims[id]->hit(r.ray, h);
+				if (t > 0.0 && (t < best.hit.t || (t == best.hit.t && id < best.id))) {
+					best.hit = h;
+					best.id = id;
+				}
+			}
+		if (best.hit.surface && best.hit.t <= t_exit)
+			return true;
+
+		if (t_next[axis] > t1)
+			return false;
+		c[axis] += step[axis];
+		if (c[axis] < 0 || c[axis] >= res[axis])
+			return false;
+		t_enter = t_next[axis];
+		t_next[axis] += t_delta[axis];
+	}
+}
+
+/**
+ * Walks the cells of the grid hit by the ray in [t_begin, t_end] looking
+ * for occluders. A surface spanning several cells is only counted in the
+ * cell that holds its hit point, [range_lo, range_hi) for the first and
+ * last cells, so the transparent ones are not counted twice.
+ * @param  prims     The surfaces of the scene
+ * @param  r         The ray data
+ * @param  t_begin   The start of the interval
+ * @param  t_end     The end of the interval
+ * @param  range_lo  The lower t bound of hits counted in the first cell
+ * @param  range_hi  The upper t bound of hits counted in the last cell
+ * @param  t_max     The distance to the light source
+ * @param  ignore    The surface the ray starts from, never counted
+ * @param  out_alpha The sum of the alphas of the transparent occluders
+ * @param  out_count The number of transparent occluders
+ * @return           true if an opaque surface blocks the ray
+ */
+bool Grid::any_in(const std::vector<Surface*>& prims, const GridRay& r, float t_begin, float t_end,
+									float range_lo, float range_hi, float t_max, Surface *ignore, float& out_alpha, int& out_count) {
+	float t0, t1;
+	if (!clip(r, t_begin, t_end, t0, t1))
+		return false;
+	int c[3], step[3];
+	float t_next[3], t_delta[3];
+	dda_setup(r, t0, c, step, t_next, t_delta);
+
+	float t_enter = t0, lo = range_lo;
+	for (;;) {
+		int axis = t_next[0] < t_next[1]? (t_next[0] < t_next[2]? 0: 2): (t_next[1] < t_next[2]? 1: 2);
+		bool last = t_next[axis] > t1 || c[axis]+step[axis] < 0 || c[axis]+step[axis] >= res[axis];
+		float t_exit = std::min(t_next[axis], t1), hi = last? range_hi: t_exit;
+		int index = (c[2]*res[1] + c[1])*res[0] + c[0];
+
+		if (!children.empty() && children[index]) {
+			if (children[index]->any_in(prims, r, t_enter, t_exit, lo, hi, t_max, ignore, out_alpha, out_count))
+				return true;
+		}
+		else
+			for (int i=cell_start[index]; i!=cell_start[index+1]; i++) {
+				Surface *s = prims[items[i]];
+				if (s == ignore)
+					continue;
+				Hit h;
+				float t = s->hit(r.ray, h);
+				if (t > 0.0 && t <= t_max && t >= lo && t < hi) {
+					if (h.prim->mtl_color.alpha >= 1.0)
+						return true;
+					out_alpha += h.prim->mtl_color.alpha;
+					out_count++;
+				}
+			}
+
+		if (last)
+			return false;
+		c[axis] += step[axis];
+		t_enter = lo = t_next[axis];
+		t_next[axis] += t_delta[axis];
+	}
+}
+
+/**
+ * The grid is rebuilt, which takes about as long as a refit would
+ * @return true
+ */
+bool Grid::refit() {
+	std::vector<Surface*> surfaces(prims);
+	build(surfaces);
+	return true;
+}
+
+/**
+ * Finds the surface whose first intersection is the closest one in front
+ * of the origin. Ties are broken by the order of the surfaces in the scene.
+ * @param  ray     The ray to trace
+ * @param  out_hit The hit of the closest surface, t is INFINITY if none
+ * @return         The closest surface, or NULL if none is hit
+ */
+Surface* Grid::closest_hit(Ray ray, Hit& out_hit) {
+	GridHit best;
+	if (!prims.empty())
+		closest_in(prims, GridRay(ray), 0.0, INFINITY, best);
+	out_hit = best.hit;
+	return out_hit.surface;
+}
+
+/**
+ * Occlusion query for shadow rays, see BVH::any_hit
+ * @param  ray       The shadow ray
+ * @param  t_max     The distance to the light source
+ * @param  ignore    The surface the ray starts from, never counted
+ * @param  out_alpha The sum of the alphas of the transparent occluders
+ * @param  out_count The number of transparent occluders
+ * @return           true if an opaque surface blocks the ray
+ */
+bool Grid::any_hit(Ray ray, float t_max, Surface *ignore, float& out_alpha, int& out_count) {
+	out_alpha = 0.0; out_count = 0;
+	if (prims.empty())
+		return false;
+	return any_in(prims, GridRay(ray), 0.0, t_max, -INFINITY, INFINITY, t_max, ignore, out_alpha, out_count);
+}
+
+/**
+ * The box of the grid, which encloses all surfaces
+ * @return The bounding box
+ */
+AABB Grid::get_bounds() {
+	return box;
+}
+
+/**
+ * The size of the cells, the surface lists and the child grids
+ * @return The size in bytes
+ */
+size_t Grid::memory() {
+	size_t bytes = cell_start.size()*sizeof(int) + items.size()*sizeof(int) + children.size()*sizeof(Grid*) +
+								 prims.size()*sizeof(Surface*);
+	for (Grid *child : children)
+		if (child)
+			bytes += sizeof(Grid) + child->memory();
+	return bytes;
+}
+
+/**
+ * Number of child grids below this one
+ * @return The count
+ */
+int Grid::child_count() {
+	int count = 0;
+	for (Grid *child : children)
+		if (child)
+			count += 1 + child->child_count();
+	return count;
+}
+
+/**
+ * Prints statistics about the grid
+ */
+void Grid::print() {
+	printf("Grid:= surfaces: %zu levels: %i resolution: %ix%ix%i surface refs: %zu child grids: %i (%zu bytes)\n",
+		prims.size(), levels, res[0], res[1], res[2], items.size(), child_count(), memory());
+}
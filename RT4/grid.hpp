@@ -0,0 +1,55 @@
+#ifndef _GRID_HPP
+#define _GRID_HPP
+
+#include <vector>
+
+#include "accel.hpp"
+#include "geometry.hpp"
+#include "surfaces.hpp"
+
+/** Per-ray data and the best hit so far. Defined in grid.cpp */
+struct GridRay;
+struct GridHit;
+
+/**
+ * Grid is derived from Accelerator. It is a uniform grid over the box of
+ * the scene and is traversed cell by cell along the ray with a 3D-DDA.
+ * Each cell lists the surfaces whose boxes overlap it. It suits scenes of
+ * evenly spread surfaces, like sphere clouds, and builds in linear time.
+ * With two levels the grid is coarse and every crowded cell gets a finer
+ * grid of its own, which copes better with surfaces that are bunched up.
+ * cell_start:	the surfaces of cell c are items[cell_start[c], cell_start[c+1])
+ * items:	indices into prims
+ * children:	the finer grid of each cell or NULL, empty for one level
+ */
+class Grid : public Accelerator {
+	int levels;
+	AABB box;
+	int res[3];
+	float cell[3];
+	std::vector<int> cell_start;
+	std::vector<int> items;
+	std::vector<Grid*> children;
+	std::vector<Surface*> prims; // the surfaces, only kept by the top grid
+	void clear();
+	void build_cells(const std::vector<AABB>& boxes, const std::vector<int>& ids, const AABB& bounds,
+									 float density, int levels);
+	bool clip(const GridRay& r, float t_begin, float t_end, float& out_t0, float& out_t1);
+	void dda_setup(const GridRay& r, float t0, int c[3], int step[3], float t_next[3], float t_delta[3]);
+	bool closest_in(const std::vector<Surface*>& prims, const GridRay& r, float t_begin, float t_end, GridHit& best);
+	bool any_in(const std::vector<Surface*>& prims, const GridRay& r, float t_begin, float t_end,
+							float range_lo, float range_hi, float t_max, Surface *ignore, float& out_alpha, int& out_count);
+	int child_count();
+public:
+	Grid(int levels=1);
+	~Grid();
+	void build(const std::vector<Surface*>& surfaces);
+	bool refit();
+	Surface* closest_hit(Ray ray, Hit& out_hit);
+	bool any_hit(Ray ray, float t_max, Surface *ignore, float& out_alpha, int& out_count);
+	AABB get_bounds();
+	size_t memory();
+	void print();
+};
+
+#endif
@@ -1,12 +1,14 @@
 #include "image.hpp"
 
+#include <cctype>
 #include <cmath>
 #include <cstdio>
-#include <fstream>
+#include <cstdlib>
 #include <iostream>
-#include <sstream>
 #include <string>
 
+#include "allexceptions.hpp"
+
 #define PI 3.14159265
 
 /**********************************/
@@ -25,20 +27,24 @@ Image::Image() {}
 Image::Image(int width, int height, Color bkg) {
 	this->width = width; this->height = height;
 	this->aspect = (float)width/(float)height;
-	image.reserve(width*height);
-	for (int i=0; i!=width*height; i++)
-		image[i] = bkg;
+	image.assign(width*height, bkg);
 }
 
 /**
  * Save the image to an output file with name 'name'
- * @param name The name of the output file
+ * @param  name The name of the output file
+ * @return      false if the file could not be opened or written, after
+ *              printing why
  */
-void Image::save(std::string name) {
+bool Image::save(std::string name) {
 
 	#define PIX_PER_LINE 5
 
 	FILE *fp = fopen(name.c_str(), "w");
+	if (!fp) {
+		perror(name.c_str());
+		return false;
+	}
 
 	/* Header containers */
 	fprintf(fp, "P3\n");
@@ -58,9 +64,45 @@ void Image::save(std::string name) {
 		fprintf(fp, "%i %i %i ", r, g, b);
 	}
 
-	/* cleanup */
-	fclose(fp);
+	/* cleanup, a write that failed sets the error flag of the stream */
+	bool ok = !ferror(fp);
+	ok = fclose(fp) == 0 && ok;
+	if (!ok)
+		perror(name.c_str());
+	return ok;
+}
 
+/**
+ * Save the image so that a reader never sees it half written: it is saved
+ * next to the output file first and then renamed over it.
+ * @param  name The name of the output file
+ * @return      false if it was not saved, the old file is then left alone
+ */
+bool Image::save_atomic(std::string name) {
+	std::string tmp = name + ".tmp";
+	if (!save(tmp)) {
+		remove(tmp.c_str());
+		return false;
+	}
+	if (rename(tmp.c_str(), name.c_str()) != 0) {
+		perror(name.c_str());
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * A rectangle of the image as an image of its own
+ * @param  rect The pixels, inside the image
+ * @return      The image of the rectangle
+ */
+Image Image::crop(const Rect& rect) {
+	Image ret(rect.x1-rect.x0, rect.y1-rect.y0);
+	for (int r=rect.y0; r!=rect.y1; r++)
+		for (int c=rect.x0; c!=rect.x1; c++)
+			ret(r-rect.y0, c-rect.x0) = (*this)(r, c);
+	return ret;
 }
 
 /**
@@ -84,7 +126,15 @@ ViewWindow::ViewWindow(){}
  * @constructor
  * @param params 	The parameter structure
  */
-ViewWindow::ViewWindow(Params params) {
+ViewWindow::ViewWindow(Params params) : ViewWindow(params, Rect{0, 0, params.width, params.height}) {}
+
+/** 
+ * @constructor
+ * Only the rays of the pixels in rect are made, in scanline order.
+ * @param params 	The parameter structure
+ * @param rect 		The pixels
+ */
+ViewWindow::ViewWindow(Params params, const Rect& rect) : rect(rect) {
 	bool par = params.parallel;
 
 	view_origin = params.eye;
@@ -114,9 +164,9 @@ ViewWindow::ViewWindow(Params params) {
 	dh = (ur - ul) / (params.width-1);
 	dv = (ll - ul) / (params.height-1);
 
-	all_rays.reserve(params.width*params.height);
-	for (float r=0; r!=params.height; r++)
-		for (float c=0; c!=params.width; c++) {
+	all_rays.reserve((size_t) (rect.x1-rect.x0)*(rect.y1-rect.y0));
+	for (float r=rect.y0; r!=rect.y1; r++)
+		for (float c=rect.x0; c!=rect.x1; c++) {
 			Vec3 corner = ul + c*dh + r*dv;
 			Ray ray(par? corner: view_origin,  par? view_dir: corner,  par);	
 			ray.r = r; ray.c = c;
@@ -158,27 +208,32 @@ void ViewWindow::print() {
 Texture::Texture() {}
 
 Texture::Texture(std::string file_name) {
-	/* Verify that file exists */
-	std::ifstream in( file_name.c_str() );
-	if (!in.is_open()) {
-		std::cout << "could not open texture file \'" << file_name << "\'\n";
-		exit(1);
-	}
-	
-	/* Read entire contents of file into stringstream */
-	std::stringstream ss;
-	ss << in.rdbuf();
-	in.close();
-
-	/* Get the width and height from the header */
-	int width, height; std::string d;
-	ss >> d >> width >> height >> d;
+	/* Read the entire file and parse it in place */
+	FILE *fp = fopen(file_name.c_str(), "rb");
+	if (!fp)
+		throw invalid_file(file_name);
+	std::string data;
+	char buf[1 << 16];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		data.append(buf, n);
+	fclose(fp);
+
+	/* Get the width and height from the header, after the magic number */
+	const char *p = data.c_str();
+	char *end;
+	while (isspace(*p)) p++;
+	while (*p && !isspace(*p)) p++;
+	int width = strtol(p, &end, 10); p = end;
+	int height = strtol(p, &end, 10); p = end;
+	strtol(p, &end, 10); p = end;
 	img = Image(width, height);
-	
+
 	/* read r g b values */
 	for(int index=0; index < width*height; index++) {
-		int r, g, b;
-		ss >> r >> g >> b;
+		int r = strtol(p, &end, 10); p = end;
+		int g = strtol(p, &end, 10); p = end;
+		int b = strtol(p, &end, 10); p = end;
 		img(index/width, index%width) = Pixel((float)r/255.0, (float)g/255.0, (float)b/255.0);
 	}
 
@@ -215,3 +270,32 @@ Pixel Texture::operator()(float u, float v) {
 		ret = ret + alpha*beta*img(j+1, i+1);
 	return ret;
 }
+
+/******************************************/
+/************** TextureCache **************/
+/******************************************/
+
+/** Deletes the textures */
+TextureCache::~TextureCache() {
+	for (auto& t : textures)
+		delete t.second;
+}
+
+/**
+ * The texture of a file, read the first time it is asked for. The file is
+ * known by its real path, so the names of it relative to different scenes
+ * find the same texture.
+ * @param  file_name The file
+ * @return           The texture
+ */
+Texture* TextureCache::get(std::string file_name) {
+	char *real = realpath(file_name.c_str(), NULL);
+	std::string key = real? real: file_name;
+	free(real);
+	auto it = textures.find(key);
+	if (it != textures.end())
+		return it->second;
+	Texture *texture = new Texture(file_name);
+	textures[key] = texture;
+	return texture;
+}
@@ -1,6 +1,7 @@
 #ifndef _IMAGE_H
 #define _IMAGE_H
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -10,6 +11,11 @@
 /** For readability, Pixel is a Color. */
 typedef Color Pixel;
 
+/** A rectangle of pixels: the columns [x0, x1) of the rows [y0, y1) */
+struct Rect {
+	int x0, y0, x1, y1;
+};
+
 /** 
  * Image object which represents the image. Use the operator(r, c) 
  * to access the pixel found at row r and column c, 0 indexed. 
@@ -23,12 +29,15 @@ public:
 	Image();
 	Image(int width, int height, Color bkg = Color(0.0, 0.0, 0.0));
 	Pixel& operator()(int r, int c);
-	void save(std::string name="output.ppm");
+	bool save(std::string name="output.ppm");
+	bool save_atomic(std::string name);
+	Image crop(const Rect& rect);
 };
 
 /**
  * Viewing Window. End goal is to get all the rays going from the origin
- * through a pixel in the viewing window.
+ * through a pixel in the viewing window, or through the pixels of a
+ * rectangle of it.
  */
 class ViewWindow {
 	Vec3 ul, ur, ll, lr;
@@ -39,9 +48,11 @@ class ViewWindow {
 	Vec3 dh, dv;
 public:
 	float aspect, d;
+	Rect rect; // the pixels of all_rays
 	std::vector<Ray> all_rays;
 	ViewWindow();
 	ViewWindow(struct Params);
+	ViewWindow(struct Params, const Rect& rect);
 	void print();
 };
 
@@ -57,4 +68,15 @@ public:
 	void print();
 };
 
+/**
+ * The textures read so far, by file. Scenes that use the same file, like
+ * the jobs of a batch, share one decoded copy. The cache owns them.
+ */
+class TextureCache {
+	std::map<std::string, Texture*> textures;
+public:
+	~TextureCache();
+	Texture* get(std::string file_name);
+};
+
 #endif
\ No newline at end of file
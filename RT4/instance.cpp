@@ -0,0 +1,141 @@
+#include "instance.hpp"
+
+#include <cstdio>
+
+/*************************************/
+/*************** Mesh ****************/
+/*************************************/
+
+/**
+ * @constructor
+ * @param name The name the instances refer to the mesh by
+ */
+Mesh::Mesh(std::string name) {
+	this->name = name;
+}
+
+/** The mesh owns its triangles */
+Mesh::~Mesh() {
+	for (Surface *triangle : triangles)
+		delete triangle;
+}
+
+/**
+ * Builds the BVH over the triangles of the mesh. Must be called before any
+ * instance of the mesh is put into the scene BVH.
+ * @param builder The BVH builder to use
+ * @param layout  The node layout of the BVH
+ */
+void Mesh::build(BVHBuilder builder, BVHLayout layout) {
+	bvh.build(triangles, builder, layout);
+}
+
+/**
+ * Moves the triangles to the positions in vertex_array and refits the BVH.
+ * The instances follow, as their bounds come from the BVH.
+ * @return true if the BVH was rebuilt rather than refit
+ */
+bool Mesh::refit() {
+	for (Surface *triangle : triangles)
+		triangle->update_vertices();
+	return bvh.refit();
+}
+
+void Mesh::print() {
+	printf("Mesh:= %s triangles: %zu ", name.c_str(), triangles.size());
+	bvh.print();
+}
+
+/*************************************/
+/************* Instance **************/
+/*************************************/
+
+/** Empty constructor for declaration purposes */
+Instance::Instance() { type=4; mesh=NULL; }
+
+/**
+ * @constructor
+ * @param mesh     The mesh to draw
+ * @param to_world The transform from the space of the mesh to the world
+ */
+Instance::Instance(Mesh *mesh, Transform to_world) {
+	this->mesh = mesh;
+	this->to_world = to_world;
+	to_object = to_world.inverse();
+	t_idx = -1;
+	type = 4;
+}
+
+void Instance::print() {
+	printf("Instance:= %s ", mesh->name.c_str());
+	to_world.print();
+}
+
+/**
+ * Traces the ray through the mesh. The direction is not normalized after
+ * the transform, so t is the same in both spaces. The triangle hit is the
+ * prim of the record.
+ * @param  r       The ray
+ * @param  out_hit The record of the hit
+ * @return         The t of the closest triangle in front of the origin,
+ *                 or -1.0 if there is none.
+ */
+float Instance::hit(Ray r, Hit& out_hit) {
+	Ray local(to_object.point(r.org), to_object.vector(r.dir), true);
+	if (!mesh->bvh.closest_hit(local, out_hit)) {
+		out_hit.surface = this;
+		return out_hit.t = out_hit.t_max = -1.0;
+	}
+
+	out_hit.surface = this;
+	return out_hit.t;
+}
+
+/**
+ * Returns the surface normal of the triangle hit, moved to the world with
+ * the inverse transpose of the transform.
+ * @param  hit       The record of the hit
+ * @param  intersect The point of intersection in the world
+ * @return           The unit normal vector N
+ */
+Vec3 Instance::get_normal(const Hit& hit, Vec3 intersect) {
+	Vec3 n = hit.prim->get_normal(hit, to_object.point(intersect));
+	return to_object.transpose_vector(n).normalize();
+}
+
+/**
+ * Returns the box enclosing the transformed box of the mesh
+ * @return The bounding box
+ */
+AABB Instance::get_bounds() {
+	AABB local = mesh->bvh.get_bounds(), box;
+	if (local.lo.x > local.hi.x)
+		return box;
+	for (int i=0; i!=8; i++) {
+		Vec3 corner(i&1? local.hi.x: local.lo.x, i&2? local.hi.y: local.lo.y, i&4? local.hi.z: local.lo.z);
+		box.grow(to_world.point(corner));
+	}
+	return box;
+}
+
+/**
+ * Get the u texture coordinate of the triangle hit
+ * @param  hit The record of the hit
+ * @param  p   The point on the instance
+ * @return     The u texture coordinate
+ */
+float Instance::get_u(const Hit& hit, Vec3& p) {
+	Vec3 local = to_object.point(p);
+	return hit.prim->get_u(hit, local);
+}
+
+/**
+ * Get the v texture coordinate of the triangle hit
+ * @param  hit The record of the hit
+ * @param  p   The point on the instance
+ * @return     The v texture coordinate
+ */
+float Instance::get_v(const Hit& hit, Vec3& p) {
+	Vec3 local = to_object.point(p);
+	return hit.prim->get_v(hit, local);
+}
@@ -0,0 +1,49 @@
+#ifndef _INSTANCE_HPP
+#define _INSTANCE_HPP
+
+#include <string>
+#include <vector>
+
+#include "bvh.hpp"
+#include "geometry.hpp"
+#include "surfaces.hpp"
+
+/**
+ * Mesh is a named group of triangles with its own BVH. It is stored once
+ * and drawn through any number of Instances.
+ */
+class Mesh {
+public:
+	std::string name;
+	std::vector<Surface*> triangles;
+	BVH bvh;
+	Mesh(std::string name);
+	~Mesh();
+	void build(BVHBuilder builder=BVH_SAH, BVHLayout layout=BVH_FLOAT);
+	bool refit();
+	void print();
+};
+
+/**
+ * Instance is derived from a surface. It places a Mesh in the scene with a
+ * transform. Rays are moved into the space of the mesh and traced against
+ * its BVH, so a mesh drawn many times is only stored once.
+ * hit gives the triangle that was hit as the prim of the Hit, where the
+ * shading calls find it with its mtl_color and t_idx. The instance is a
+ * single surface to the shadow query, so it does not shadow itself.
+ */
+class Instance : public Surface {
+	Mesh *mesh;
+	Transform to_world, to_object;
+public:
+	Instance();
+	Instance(Mesh *mesh, Transform to_world);
+	void print();
+	float hit(Ray r, Hit& out_hit);
+	Vec3 get_normal(const Hit& hit, Vec3 intersect);
+	AABB get_bounds();
+	float get_u(const Hit& hit, Vec3& p);
+	float get_v(const Hit& hit, Vec3& p);
+};
+
+#endif
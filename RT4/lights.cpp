@@ -7,6 +7,7 @@
 /***************************/
 
 LightSource::LightSource() {}
+LightSource::~LightSource() {}
 void LightSource::print() {
 	printf("LightSource:= (%.3f, %.3f, %.3f) Color:= (%.3f, %.3f, %.3f)\n", p.x, p.y, p.z, c.r, c.g, c.b);
 }
@@ -9,6 +9,7 @@ public:
 	float w;
 	Color c;
 	LightSource();
+	virtual ~LightSource();
 	virtual void print();
 };
 
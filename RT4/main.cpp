@@ -1,85 +1,101 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
+#include <fstream>
 #include <iostream>
-#include <random>
+#include <sstream>
+#include <utility>
 #include <vector>
 
+#include <unistd.h>
+
+#include "accel.hpp"
+#include "allexceptions.hpp"
+#include "bvh.hpp"
+#include "checkpoint.hpp"
+#include "cloud.hpp"
+#include "farm.hpp"
 #include "geometry.hpp"
+#include "grid.hpp"
 #include "image.hpp"
+#include "instance.hpp"
 #include "lights.hpp"
 #include "params.hpp"
+#include "rayqueue.hpp"
+#include "sampler.hpp"
+#include "scheduler.hpp"
 #include "utils.hpp"
 #include "surfaces.hpp"
-
-std::default_random_engine generator;
-std::normal_distribution<float> distribution(0.0, 1.0);
+#include "writer.hpp"
 
 #define _CLAMP(x) (x>1.0? 1.0: x)
 #define CLAMP(c) (Color(_CLAMP(c.r), _CLAMP(c.g), _CLAMP(c.b)))
-#define RAND() (static_cast <float> (rand()) / static_cast <float> (RAND_MAX))
-#define RANDN() (distribution(generator))
 #define PI 3.14159265
 #define OFFSET .02
 
-#define DEFAULT_R_D 5		// Recursive depth for reflections
-#define DEFAULT_T_D 5		// Recursive depth for refractions
+#define BENCHMARK_PASSES 8	// times the primary rays are traced per structure
+#define BENCHMARK_SECONDS 2.0	// or for this long at most
+#define RENDER_TILE 16		// side of the tiles handed to the threads when there are no packets
+#define LENS_STREAM (~0ULL)	// the sampler stream of the depth of field, apart from the pixels
+#define FARM_BAND 16		// rows of the image in a band of the render farm
+#define FARM_JOB 2		// bands handed to a worker at a time
+#define CHECKPOINT_TILE 64	// side of the tiles of a pass, rendered one after another between checkpoints
+#define WRITER_QUEUE 2		// images waiting for the writer thread before rendering waits for it
+#define BUDGET_MAX_BUNDLE 16	// most shadow rays per light the time budget picks
+#define BUDGET_MAX_PASSES 64	// most passes the time budget picks without --passes
+#define BUDGET_MIN_PASSES 4	// passes left room for when the time budget picks depth and bundle
+#define BUDGET_MARGIN 0.9	// share of the time budget planned for, the rest covers misestimates
 
 Params params;
+Options options;
 std::vector<Surface*> surfaces;
 std::vector<LightSource*> lights;
 std::vector<Texture*> textures;
+TextureCache texture_cache; // the textures of every scene read, shared by the jobs of a batch
+std::vector<Mesh*> meshes;
+Accelerator *accel = NULL;
+std::atomic<long long> ray_count(0); // rays traced, for the throughput report
+thread_local long long thread_rays = 0; // rays traced by this thread, added to ray_count after each tile
+std::atomic<long long> shadow_count(0); // the shadow rays among them, for the time budget
+thread_local long long thread_shadow_rays = 0;
+std::atomic<long long> primary_count(0); // the primary rays among them
 
 float get_shadow_flag(LightSource *source, Ray shadow_ray, Vec3& L,
 											Surface *surface, Vec3& intersect);
-Color get_color(Ray r, float t, Surface *surface, bool reflect=true, bool refract=true);
-Surface* trace_ray(Ray ray, float &out_alpha, float offset=0.0);
-Color reflect_ray(Vec3 intersect, Vec3 I, Vec3 N, float eta, int depth);
-Color refract_ray(Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int depth);
-float randn() {
-
-}
+Color get_color(Ray r, float t, const Hit& hit, Sampler& sampler, bool reflect=true, bool refract=true);
+Surface* trace_ray(Ray ray, float &out_alpha, Hit& out_hit, float offset=0.0);
+Color reflect_ray(Vec3 intersect, Vec3 I, Vec3 N, float eta, int depth, Sampler& sampler);
+Color refract_ray(Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int depth, Sampler& sampler);
 
 /**
- * Gets the shadow flag value for the given surface and vector
+ * Gets the shadow flag value for the given surface and vector.
+ * An opaque occluder blocks the light completely, otherwise the light is
+ * dimmed by the average alpha of the transparent occluders.
  * @param  source     The light source
  * @param  shadow_ray The shadow ray
  * @param  L          The direction from intersection to light source
- * @param  surface    The surface object whose shadows we wish to cast
+ * @param  surface    The surface the ray starts from, never an occluder. NULL
+ *                    if every surface may be
  * @param  intersect  The point of intersection on that surface
  * @return            The shadow value
  */
 float get_shadow_flag(LightSource *source, Ray shadow_ray, Vec3& L,
 											Surface *surface, Vec3& intersect) {
-	float shadow = 1.0, diff = 0.0;
-	int count = 0;
-	for (Surface *s : surfaces) {
-		if (s != surface) {
-			/* get intersection. skip if no intersection. */
-			float dummy, alpha = s->hit(shadow_ray, dummy);
-
-			if (alpha > 0.0) {
-				bool is_valid = true;
-
-				/* for point-source: valid when intersection is before light source */
-				if (source->w != 0.0) {
-					Vec3 shadow_intersect = shadow_ray(alpha);
-					is_valid =  (shadow_intersect - intersect).norm() <= 
-			  							(source->p - intersect).norm();
-				}
+	/* for point-source: only occluders before the light source count */
+	float t_max = source->w == 0.0? INFINITY: (source->p - intersect).norm();
 
-				if (is_valid) {
-					diff += s->mtl_color.alpha;
-					count++;
-					// shadow = 0.0;
-					// break;
-				}
-			}
-		}
-	}
+	float diff; int count;
+	thread_rays++;
+	thread_shadow_rays++;
+	if (accel->any_hit(shadow_ray, t_max, surface, diff, count))
+		return 0.0;
 
+	float shadow = 1.0;
 	if (count>0)
 		shadow -= diff/(float) count;
 
@@ -95,12 +111,14 @@ float get_shadow_flag(LightSource *source, Ray shadow_ray, Vec3& L,
  * @param  alpha     The 
  * @param  eta       The refractive index
  * @param  depth     Number of iterations
+ * @param  sampler   The random numbers of the pixel
  * @return           The color
  */
-Color refract_ray(Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int depth) {
+Color refract_ray(Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int depth, Sampler& sampler) {
 	Color ret = Color(0.0, 0.0, 0.0);
 	float t1, t2, __offset;
 	Surface *s;
+	Hit hit;
 	for (int i=0; i!=depth && eta>=0.0; i++) {
 		/* use the desired normal */
 		float cos_val = I.dot(N);
@@ -117,9 +135,9 @@ Color refract_ray(Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int de
 		float r_eta = 1.0/eta;
 		Vec3 T_dir = -1.0*N*sqrt( 1.0 - powf(r_eta, 2.0)*(1-powf(cos_val, 2.0)) ) + r_eta*(cos_val*N-I);
 		Ray T1 = Ray(intersect, T_dir.normalize(), true);
-		for (	s = trace_ray(T1, t1, __offset=OFFSET); 
+		for (	s = trace_ray(T1, t1, hit, __offset=OFFSET); 
 					t1<0.001 && s;
-					s = trace_ray(T1, t1, __offset+=.001)
+					s = trace_ray(T1, t1, hit, __offset+=.001)
 				);
 
 		if (!s)
@@ -128,7 +146,7 @@ Color refract_ray(Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int de
 		/* get new parameters */
 		I = (intersect-T1(t1)).normalize();
 		intersect = T1(t1);
-		N = s->get_normal(intersect);
+		N = s->get_normal(hit, intersect);
 		
 		/* get angle */
 		cos_val = I.dot(N);
@@ -141,9 +159,9 @@ Color refract_ray(Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int de
 		r_eta = 1.0/r_eta;
 		T_dir = -1.0*N*sqrt( 1.0 - powf(r_eta, 2.0)*(1-powf(cos_val, 2.0)) ) + r_eta*(cos_val*N-I);
 		Ray T2 = Ray(intersect, T_dir.normalize(), true);
-		for (	s = trace_ray(T2, t2, __offset=OFFSET);
+		for (	s = trace_ray(T2, t2, hit, __offset=OFFSET);
 					t2<0.001 && s;
-					s = trace_ray(T1, t2, __offset+=.001)
+					s = trace_ray(T1, t2, hit, __offset+=.001)
 				);
 
 		if (!s)
@@ -151,14 +169,14 @@ Color refract_ray(Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int de
 			
 		/* add color using beers law for attenuation */
 		float beers_law = exp( -1.0*alpha*fabs(t2-t1) );
-		ret = ret + (1.0-Fr)*beers_law*get_color(T2, t2, s, true, false);
+		ret = ret + (1.0-Fr)*beers_law*get_color(T2, t2, hit, sampler, true, false);
 
 		/* get values for next iteration */
 		I = (intersect - T2(t2)).normalize();
 		intersect = T2(t2);
-		N = s->get_normal(intersect);
-		eta = s->mtl_color.eta;
-		alpha = s->mtl_color.alpha;
+		N = s->get_normal(hit, intersect);
+		eta = hit.prim->mtl_color.eta;
+		alpha = hit.prim->mtl_color.alpha;
 	}
 	return ret;
 }
@@ -171,9 +189,10 @@ Color refract_ray(Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int de
  * @param  N         The surface normal
  * @param  eta       The index of refraction of the intersected object
  * @param  depth     Recursive depth
+ * @param  sampler   The random numbers of the pixel
  * @return           Returns the compound color. Color might overflow but not underflow.
  */
-Color reflect_ray(Vec3 intersect, Vec3 I, Vec3 N, float eta, int depth) {
+Color reflect_ray(Vec3 intersect, Vec3 I, Vec3 N, float eta, int depth, Sampler& sampler) {
 	Color ret = Color(0.0, 0.0, 0.0);
 	while (depth-- > 0 && eta>=0.0) {
 
@@ -190,19 +209,20 @@ Color reflect_ray(Vec3 intersect, Vec3 I, Vec3 N, float eta, int depth) {
 
 		/* get the color of closest reflected surface */
 		float __offset;
-		Surface *s = trace_ray(R, t, __offset=OFFSET);
+		Hit hit;
+		Surface *s = trace_ray(R, t, hit, __offset=OFFSET);
 		while (t<0.001 && s) {
-			s = trace_ray(R, t, __offset+=.001);
+			s = trace_ray(R, t, hit, __offset+=.001);
 		}
 		if (!s)
 			break;
 
 		/* get ready for next iteration */
-		ret = ret + Fr*get_color(R, t, s, false, true);
+		ret = ret + Fr*get_color(R, t, hit, sampler, false, true);
 		I = (intersect - R(t)).normalize();
 		intersect = R(t);
-		N = s->get_normal(intersect);
-		eta = s->mtl_color.eta;
+		N = s->get_normal(hit, intersect);
+		eta = hit.prim->mtl_color.eta;
 	}
 
 	return CLAMP(ret);
@@ -212,36 +232,40 @@ Color reflect_ray(Vec3 intersect, Vec3 I, Vec3 N, float eta, int depth) {
 
 
 /**
- * Gets the color using Phong Illumination and shadows
- * @param  r       		The ray which itersects the surface
- * @param  t       		The parameter value for r at the point of intersection
- * @param  surface 		The surface which is intersected by r
- * @param  reflect 		Flag to decide if to calculate reflections. Default is true.
- * @param  refract 		Flag to decide if to calculate refractions. Default is true.
- * @return         		The color for the intersection point
+ * The direct lighting of a point with Phong Illumination and shadows: the
+ * ambient term, and the diffuse and specular term of every light source.
+ * It also gives the normal used to send out reflected and refracted rays.
+ * @param  r          The ray which itersects the surface
+ * @param  t          The parameter value for r at the point of intersection
+ * @param  hit        The hit of r, with the surface and its material
+ * @param  sampler    The random numbers of the pixel, for soft shadows
+ * @param  out_direct The term of each light source, in the order of lights
+ * @param  out_N      The normal for reflections and refractions
+ * @return            The ambient term
  */
-Color get_color(Ray r, float t, Surface *surface, bool reflect, bool refract) {
+Color direct_light(Ray r, float t, const Hit& hit, Sampler& sampler, std::vector<Color>& out_direct, Vec3& out_N) {
 	/* setup */
-	MtlColor mtlcolor = surface->mtl_color;
+	Surface *surface = hit.surface;
+	MtlColor mtlcolor = hit.prim->mtl_color;
 	Vec3 intersect = r(t);
 	
 	float ka = mtlcolor.ka, kd = mtlcolor.kd, ks = mtlcolor.ks, n = mtlcolor.n;
 	Color Os = mtlcolor.Os, Od; float u, v;
-	if (surface->t_idx == -1)
+	if (hit.prim->t_idx == -1)
 		Od = mtlcolor.Od;
 	else {
-		Texture *t = textures[surface->t_idx];
-		u = surface->get_u(intersect);
-		v = surface->get_v(intersect);
+		Texture *t = textures[hit.prim->t_idx];
+		u = surface->get_u(hit, intersect);
+		v = surface->get_v(hit, intersect);
 		Od = t->operator()(u, v);
 	}
 
-	/* ambient term */
-	Color ret = ka*Od;
-	
+	/* the particles of a cloud shadow each other, so the cloud is not skipped by the shadow rays */
+	Surface *ignore = surface->type==5? NULL: surface;
+	out_direct.clear();
 	for (LightSource *source : lights) {
 		/* Calculate N, L, H */
-		Vec3 N = surface->get_normal(intersect);
+		Vec3 N = surface->get_normal(hit, intersect);
 		
 		Vec3 L;
 		if (source->w == 0.0)
@@ -262,20 +286,21 @@ Color get_color(Ray r, float t, Surface *surface, bool reflect, bool refract) {
 		Color specular = ks*Os*pow(d2<0.0? 0.0: d2, n);
 		
 		/* calculate soft shadows. Jitter only makes sense for point sources */
-		int bundle_size=1; // use 1 for hard shadows
+		int bundle_size=options.shadow_bundle;
 		float	shadow = get_shadow_flag(	source,
 																		Ray(intersect, L, true), 
 																		L, 
-																		surface,
+																		ignore,
 																		intersect);
 		if (source->w != 0.0) {
 			for (int i=1; i<bundle_size; i++) {
-				Vec3 jitter(RAND(), RAND(), RAND());
+				float x = sampler.uniform(), y = sampler.uniform(), z = sampler.uniform();
+				Vec3 jitter(x, y, z);
 				L = (source->p + 2.0*jitter - intersect).normalize();
 				shadow += get_shadow_flag(	source,
 																		Ray(intersect, L, true), 
 																		L, 
-																		surface,
+																		ignore,
 																		intersect);
 			}
 			shadow /= (float) bundle_size;
@@ -288,118 +313,1233 @@ Color get_color(Ray r, float t, Surface *surface, bool reflect, bool refract) {
 				intensity = Color(0.0, 0.0, 0.0);
 		}
 
-		/* add the diffuse and specular terms */
-		Color color = shadow*intensity*( diffuse + specular );
-		ret = ret + color;
-		intersect = r(t);
-		Vec3 I = (params.eye - intersect).normalize();
-		float eta = mtlcolor.eta, alpha = mtlcolor.alpha;
-		if (surface->type==3) {
-			Triangle T = *(Triangle *) surface;
-			N = Vec3(T.A, T.B, T.C).normalize();
-		}
+		/* the diffuse and specular terms */
+		out_direct.push_back(shadow*intensity*( diffuse + specular ));
+		out_N = N;
+	}
 
+	if (surface->type==3) {
+		Triangle *T = (Triangle *) surface;
+		out_N = Vec3(T->A, T->B, T->C).normalize();
+	}
+
+	/* ambient term */
+	return ka*Od;
+}
+
+/**
+ * Adds up the terms of a point. The reflected and refracted colors are
+ * added after the term of each light source.
+ * @param  ambient   The ambient term
+ * @param  direct    The term of each light source
+ * @param  n         The number of light sources
+ * @param  reflect   If there is a reflected color
+ * @param  reflected The reflected color
+ * @param  refract   If there is a refracted color
+ * @param  refracted The refracted color
+ * @return           The color for the point
+ */
+Color add_terms(Color ambient, const Color *direct, int n, bool reflect, Color reflected, bool refract,
+								Color refracted) {
+	Color ret = ambient;
+	for (int i=0; i!=n; i++) {
+		ret = ret + direct[i];
 		if (reflect)
-			ret = ret + reflect_ray(intersect, I, N, eta, DEFAULT_R_D);
+			ret = ret + reflected;
 		if (refract)
-			ret = ret	+ refract_ray(intersect, I, N, alpha, eta, DEFAULT_T_D);
+			ret = ret	+ refracted;
 	}
 
 	/* upper clamp */
 	return CLAMP(ret);
 }
 
+/**
+ * Gets the color using Phong Illumination and shadows
+ * @param  r       		The ray which itersects the surface
+ * @param  t       		The parameter value for r at the point of intersection
+ * @param  hit     		The hit of r, with the surface and its material
+ * @param  sampler 		The random numbers of the pixel
+ * @param  reflect 		Flag to decide if to calculate reflections. Default is true.
+ * @param  refract 		Flag to decide if to calculate refractions. Default is true.
+ * @return         		The color for the intersection point
+ */
+Color get_color(Ray r, float t, const Hit& hit, Sampler& sampler, bool reflect, bool refract) {
+	std::vector<Color> direct;
+	Vec3 N;
+	Color ambient = direct_light(r, t, hit, sampler, direct, N);
+
+	/* the reflected and refracted rays are the same for every light source */
+	Color reflected(0.0, 0.0, 0.0), refracted(0.0, 0.0, 0.0);
+	if (!direct.empty()) {
+		Vec3 intersect = r(t);
+		Vec3 I = (params.eye - intersect).normalize();
+		float eta = hit.prim->mtl_color.eta, alpha = hit.prim->mtl_color.alpha;
+		if (reflect)
+			reflected = reflect_ray(intersect, I, N, eta, options.depth, sampler);
+		if (refract)
+			refracted = refract_ray(intersect, I, N, alpha, eta, options.depth, sampler);
+	}
+
+	return add_terms(ambient, direct.data(), direct.size(), reflect, reflected, refract, refracted);
+}
+
 /**
  * Traces the ray and tries to find the closest intersecting surface.
  * @param  ray         The ray to trace
  * @param  out_alpha   The alpha value such that r(alpha) is the intersection point.
+ * @param  out_hit     The hit of the closest surface, for shading
  * @param  out_surface The closest surface which the ray intersects, or NULL if none.
  */
-Surface* trace_ray(Ray ray, float &out_alpha, float offset) {
+Surface* trace_ray(Ray ray, float &out_alpha, Hit& out_hit, float offset) {
 	ray.org = ray(offset);
-	float out_alpha1, out_alpha2;
-	out_alpha1 = INFINITY; 
-	Surface *s= NULL;
-	for (Surface *surface : surfaces) {
-		float alpha1, alpha2;
-		alpha1 = surface->hit(ray, alpha2);
-		if (alpha1>0.0 && alpha1 < out_alpha1) {
-			out_alpha1 = alpha1;
-			out_alpha2 = alpha2;
-			s = surface;
+	thread_rays++;
+	Surface *s = accel->closest_hit(ray, out_hit);
+
+	out_alpha = out_hit.t<0.001? out_hit.t_max: out_hit.t;
+	return s;
+}
+
+/**
+ * A get_color waiting for its reflected and refracted colors, which come
+ * from the chains reflect_chain and refract_chain (-1 if there are none).
+ * The terms of its light sources, one per light, start at direct in
+ * TileShader::directs.
+ */
+struct ShadeNode {
+	Color ambient, color;
+	int direct;
+	bool reflect, refract;
+	int reflect_chain, refract_chain;
+};
+
+/**
+ * A reflect_ray or refract_ray in progress. It keeps the variables of the
+ * loop and waits for the ray it traced last; every surface hit is shaded
+ * by a ShadeNode in children with the weight it is added with.
+ * stage:	0 to send the next ray out, 1 waiting for R or T1, 2 for T2
+ * ray:	R, T1 or T2 of the loop; when T2 starts too close, refract_ray
+ * 	traces T1 again and so does the chain
+ * pixel:	the primary hit the chain belongs to, whose sampler it uses
+ */
+struct ChainNode {
+	bool refract;
+	int stage, i, depth, pixel;
+	Vec3 intersect, I, N;
+	float eta, alpha, Fr, r_eta, t1, offset;
+	Ray T1, ray;
+	std::vector<std::pair<float, int> > children;
+	Color color;
+	ChainNode() : T1(Vec3(), Vec3(), true), ray(Vec3(), Vec3(), true) {}
+};
+
+/**
+ * Shades the primary hits of a tile with the reflected and refracted rays
+ * traced through a RayQueue instead of one by one. get_color,
+ * reflect_ray and refract_ray are unrolled into a tree of ShadeNodes and
+ * ChainNodes: each chain steps through the loop of reflect_ray or
+ * refract_ray as its rays come back, in waves of sorted batches. Every
+ * node is made after its parent, so once no ray is left the colors are
+ * added up from the last node to the first, in the same order as the
+ * recursive functions.
+ * 	add:	shades a primary hit, returns its node
+ * 	run:	traces all secondary rays and adds up the colors
+ * 	color:	the color of a node after run
+ */
+class TileShader {
+	std::vector<ShadeNode> shades;
+	std::vector<ChainNode> chains;
+	std::vector<Color> directs; // the terms of the light sources of all shades
+	std::vector<Color> direct; // the terms of the last shade
+	std::vector<std::pair<bool, int> > created; // (is a chain, index) in the order the nodes were made
+	std::vector<int> waiting; // the chain of each queued ray
+	std::vector<Sampler> samplers; // the random numbers of each primary hit
+	RayQueue queue;
+	int shade(Ray r, float t, const Hit& hit, int pixel, bool reflect, bool refract);
+	int new_chain(bool refract, Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int depth, int pixel);
+	void push(int c, const Ray& ray, float offset);
+	void step(int c);
+	void advance(int c, const Hit& hit, float t);
+public:
+	TileShader(const AABB& bounds) : queue(bounds) {}
+	int add(Ray r, float t, const Hit& hit, const Sampler& sampler);
+	void run();
+	Color color(int node);
+};
+
+/**
+ * Shades a hit: the direct light right away, reflections and refractions
+ * as chains.
+ * @param  r       The ray which intersects the surface
+ * @param  t       The parameter value for r at the point of intersection
+ * @param  hit     The hit of r, with the surface and its material
+ * @param  pixel   The primary hit it belongs to
+ * @param  reflect If to send out reflected rays
+ * @param  refract If to send out refracted rays
+ * @return         The node
+ */
+int TileShader::shade(Ray r, float t, const Hit& hit, int pixel, bool reflect, bool refract) {
+	ShadeNode node;
+	Vec3 N;
+	node.ambient = direct_light(r, t, hit, samplers[pixel], direct, N);
+	node.direct = directs.size();
+	directs.insert(directs.end(), direct.begin(), direct.end());
+	node.reflect = reflect; node.refract = refract;
+	node.reflect_chain = node.refract_chain = -1;
+	int k = shades.size();
+	shades.push_back(node);
+	created.push_back(std::make_pair(false, k));
+
+	if (!direct.empty()) {
+		Vec3 intersect = r(t);
+		Vec3 I = (params.eye - intersect).normalize();
+		float eta = hit.prim->mtl_color.eta, alpha = hit.prim->mtl_color.alpha;
+		if (reflect)
+			shades[k].reflect_chain = new_chain(false, intersect, I, N, alpha, eta, options.depth, pixel);
+		if (refract)
+			shades[k].refract_chain = new_chain(true, intersect, I, N, alpha, eta, options.depth, pixel);
+	}
+	return k;
+}
+
+/**
+ * Starts a chain with the arguments of reflect_ray or refract_ray. No
+ * chain is made if the loop would not run, its color would be black.
+ * @return The chain, or -1
+ */
+int TileShader::new_chain(bool refract, Vec3 intersect, Vec3 I, Vec3 N, float alpha, float eta, int depth,
+													int pixel) {
+	if (depth <= 0 || eta < 0.0)
+		return -1;
+	ChainNode chain;
+	chain.refract = refract;
+	chain.stage = 0; chain.i = 0; chain.depth = depth; chain.pixel = pixel;
+	chain.intersect = intersect; chain.I = I; chain.N = N;
+	chain.alpha = alpha; chain.eta = eta;
+	int c = chains.size();
+	chains.push_back(chain);
+	created.push_back(std::make_pair(true, c));
+	step(c);
+	return c;
+}
+
+/**
+ * Queues a ray for a chain, like trace_ray with an offset
+ * @param c      The chain
+ * @param ray    The ray
+ * @param offset How far along the ray to start
+ */
+void TileShader::push(int c, const Ray& ray, float offset) {
+	chains[c].offset = offset;
+	Ray traced = ray;
+	traced.org = traced(offset);
+	queue.push(traced);
+	waiting.push_back(c);
+}
+
+/**
+ * The head of the loop of reflect_ray or refract_ray: sends out R or T1,
+ * unless the loop is over.
+ * @param c The chain
+ */
+void TileShader::step(int c) {
+	ChainNode& ch = chains[c];
+	if (!ch.refract) {
+		if (!(ch.depth-- > 0 && ch.eta>=0.0))
+			return;
+
+		/* perform schlick approximation */
+		float cos_val = ch.I.dot(ch.N);
+		if (cos_val < 0.0) {
+			ch.N = -1.0*ch.N;
+			cos_val = ch.I.dot(ch.N);
 		}
+		const float F0 = powf((ch.eta-1.0)/(ch.eta+1.0), 2.0);
+		ch.Fr = F0 + (1.0-F0)*powf(1.0-cos_val, 5.0);
+		Vec3 R_dir = 2.0*cos_val*ch.N - ch.I;
+		ch.ray = Ray(ch.intersect, R_dir, true);
+		ch.stage = 1;
+		push(c, ch.ray, OFFSET);
+		return;
 	}
 
-	out_alpha = out_alpha1<0.001? out_alpha2: out_alpha1;
-	return s;
+	if (!(ch.i!=ch.depth && ch.eta>=0.0))
+		return;
+
+	/* use the desired normal */
+	float cos_val = ch.I.dot(ch.N);
+	if (cos_val<0.0) {
+		ch.N = -1.0*ch.N;
+		cos_val = ch.I.dot(ch.N);
+	}
+
+	/* Fresnell coeffs */
+	const float F0 = powf((ch.eta-1.0)/(ch.eta+1.0), 2.0);
+	ch.Fr = F0 + (1.0-F0)*powf(1.0-cos_val, 5.0);
+
+	/* Transmit ray from medium to object */
+	ch.r_eta = 1.0/ch.eta;
+	Vec3 T_dir = -1.0*ch.N*sqrt( 1.0 - powf(ch.r_eta, 2.0)*(1-powf(cos_val, 2.0)) ) + ch.r_eta*(cos_val*ch.N-ch.I);
+	ch.T1 = Ray(ch.intersect, T_dir.normalize(), true);
+	ch.ray = ch.T1;
+	ch.stage = 1;
+	push(c, ch.T1, OFFSET);
 }
 
-int main(int argc, char *argv[]) {
-	/* Basic input validation */
-	if (argc != 2) {
-		printf("usage: ./main <input-file>\n");
-		exit(1);
+/**
+ * Continues a chain with the hit of its ray, like the rest of the loop of
+ * reflect_ray or refract_ray after trace_ray
+ * @param c   The chain
+ * @param hit The closest hit, with a NULL surface if none
+ * @param t   The parameter value at the hit, as from trace_ray
+ */
+void TileShader::advance(int c, const Hit& hit, float t) {
+	ChainNode& ch = chains[c];
+	Surface *s = hit.surface;
+	if (t<0.001 && s) {
+		/* too close, try again a bit further along; refract_ray retries T2 with T1 */
+		push(c, ch.stage==2? ch.T1: ch.ray, ch.offset+=.001);
+		return;
 	}
+	if (!s)
+		return;
 
-	std::string filename(argv[1]);
+	if (!ch.refract) {
+		/* get ready for next iteration */
+		Ray R = ch.ray;
+		int child = shade(R, t, hit, ch.pixel, false, true);
+		ChainNode& chain = chains[c];
+		chain.children.push_back(std::make_pair(chain.Fr, child));
+		chain.I = (chain.intersect - R(t)).normalize();
+		chain.intersect = R(t);
+		chain.N = s->get_normal(hit, chain.intersect);
+		chain.eta = hit.prim->mtl_color.eta;
+		step(c);
+		return;
+	}
 
-	/* Get image parameters and initialize the image */
-	try {
-		params = parse_input(filename, surfaces, lights, textures);
-	} catch (std::exception& e) {
-		std::cout << e.what() << std::endl;
-		return -1;
+	if (ch.stage == 1) {
+		ch.t1 = t;
+
+		/* get new parameters */
+		ch.I = (ch.intersect-ch.T1(t)).normalize();
+		ch.intersect = ch.T1(t);
+		ch.N = s->get_normal(hit, ch.intersect);
+		
+		/* get angle */
+		float cos_val = ch.I.dot(ch.N);
+		if (cos_val < 0.0) {
+			ch.N = -1.0*ch.N;
+			cos_val = ch.I.dot(ch.N);
+		}
+
+		/* transmit ray from object to medium */
+		ch.r_eta = 1.0/ch.r_eta;
+		Vec3 T_dir = -1.0*ch.N*sqrt( 1.0 - powf(ch.r_eta, 2.0)*(1-powf(cos_val, 2.0)) ) + ch.r_eta*(cos_val*ch.N-ch.I);
+		ch.ray = Ray(ch.intersect, T_dir.normalize(), true);
+		ch.stage = 2;
+		push(c, ch.ray, OFFSET);
+		return;
 	}
-	Image img(params.width, params.height, params.bkg_color);
 
-	/* Create the viewing window */
-	ViewWindow vw(params);
+	/* add color using beers law for attenuation */
+	float t2 = t;
+	float beers_law = exp( -1.0*ch.alpha*fabs(t2-ch.t1) );
+	Ray T2 = ch.ray;
+	int child = shade(T2, t2, hit, ch.pixel, true, false);
+	ChainNode& chain = chains[c];
+	chain.children.push_back(std::make_pair((1.0-chain.Fr)*beers_law, child));
 
-	/* Fill the image with the nearest ray intersection points */
-	srand(time(NULL)); // seed for soft shadows
-  /* seed for depth of field */
-  unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-  generator = std::default_random_engine(seed);
+	/* get values for next iteration */
+	chain.I = (chain.intersect - T2(t2)).normalize();
+	chain.intersect = T2(t2);
+	chain.N = s->get_normal(hit, chain.intersect);
+	chain.eta = hit.prim->mtl_color.eta;
+	chain.alpha = hit.prim->mtl_color.alpha;
+	chain.i++;
+	step(c);
+}
 
-	for (Ray& ray : vw.all_rays) {
-		float alpha;
-		Surface *s = trace_ray(ray, alpha);
-		if (s != NULL)
-			img(ray.r, ray.c) = get_color(ray, alpha, s);
+/**
+ * Shades a primary hit
+ * @param  r   The primary ray
+ * @param  t   The parameter value for r at the point of intersection
+ * @param  hit     The hit of r
+ * @param  sampler The random numbers of the pixel
+ * @return         The node, for color
+ */
+int TileShader::add(Ray r, float t, const Hit& hit, const Sampler& sampler) {
+	samplers.push_back(sampler);
+	return shade(r, t, hit, samplers.size()-1, true, true);
+}
+
+/**
+ * Traces the queued rays in waves until every chain is over, then adds up
+ * the colors of all nodes
+ */
+void TileShader::run() {
+	std::vector<Ray> rays;
+	std::vector<Hit> hits;
+	while (!queue.empty()) {
+		std::vector<int> owners;
+		owners.swap(waiting);
+		queue.trace(accel, rays, hits);
+		thread_rays += rays.size();
+		for (size_t i=0; i!=rays.size(); i++)
+			advance(owners[i], hits[i], hits[i].t<0.001? hits[i].t_max: hits[i].t);
 	}
 
-	/* implement depth of field */
+	for (size_t k=created.size(); k-- > 0; ) {
+		if (created[k].first) {
+			ChainNode& chain = chains[created[k].second];
+			Color ret(0.0, 0.0, 0.0);
+			for (auto& child : chain.children)
+				ret = ret + child.first*shades[child.second].color;
+			chain.color = chain.refract? ret: CLAMP(ret);
+		}
+		else {
+			ShadeNode& node = shades[created[k].second];
+			Color none(0.0, 0.0, 0.0);
+			node.color = add_terms(node.ambient, &directs[node.direct], lights.size(),
+				node.reflect, node.reflect_chain<0? none: chains[node.reflect_chain].color,
+				node.refract, node.refract_chain<0? none: chains[node.refract_chain].color);
+		}
+	}
+}
+
+/**
+ * The color of a node
+ * @param  node The node from add
+ * @return      The color, after run
+ */
+Color TileShader::color(int node) {
+	return shades[node].color;
+}
+
+/**
+ * Sorts the primary rays of a rectangle into square tiles of the screen,
+ * row by row, so that the rays of a tile can be traced together.
+ * @param  rays The rays of a ViewWindow in scanline order, sorted in place
+ * @param  tile The side of the tiles in pixels
+ * @param  rect The pixels of the rays
+ * @return      The index in rays where each tile starts, and rays.size()
+ */
+std::vector<int> sort_into_tiles(std::vector<Ray>& rays, int tile, const Rect& rect) {
+	std::vector<Ray> sorted;
+	std::vector<int> starts;
+	sorted.reserve((size_t) (rect.x1-rect.x0)*(rect.y1-rect.y0));
+	for (int r0=rect.y0; r0<rect.y1; r0+=tile)
+		for (int c0=rect.x0; c0<rect.x1; c0+=tile) {
+			starts.push_back(sorted.size());
+			for (int r=r0; r!=std::min(r0+tile, rect.y1); r++)
+				for (int c=c0; c!=std::min(c0+tile, rect.x1); c++)
+					sorted.push_back(rays[(r-rect.y0)*(rect.x1-rect.x0) + c-rect.x0]);
+		}
+	starts.push_back(sorted.size());
+	rays.swap(sorted);
+	return starts;
+}
+
+/**
+ * The random numbers of a pixel in a pass over the image. Every pixel of
+ * every pass has a stream of its own, keyed by the seed.
+ * @param  ray  The primary ray of the pixel
+ * @param  pass The pass, 0 for the first and then one per depth of field ray
+ * @return      The sampler
+ */
+Sampler pixel_sampler(const Ray& ray, int pass) {
+	unsigned long long pixel = ((unsigned long long) pass*params.height + ray.r)*params.width + ray.c;
+	return Sampler(options.seed, pixel);
+}
+
+/**
+ * Traces the primary rays of a tile into img. Without packets every ray is
+ * traced by itself, otherwise the tile is traced with closest_hits and
+ * shaded with a TileShader.
+ * @param rays   The rays of the tile
+ * @param n      The number of rays
+ * @param img    The image
+ * @param bounds The box of the scene
+ * @param pass   The pass over the image, for the samplers
+ */
+void trace_tile(Ray *rays, int n, Image& img, const AABB& bounds, int pass) {
+	if (options.packet <= 1) {
+		for (int i=0; i!=n; i++) {
+			float alpha;
+			Hit hit;
+			Surface *s = trace_ray(rays[i], alpha, hit);
+			Sampler sampler = pixel_sampler(rays[i], pass);
+			if (s != NULL)
+				img(rays[i].r, rays[i].c) = get_color(rays[i], alpha, hit, sampler);
+		}
+		return;
+	}
+
+	std::vector<Hit> hits(n);
+	std::vector<int> nodes(n);
+	accel->closest_hits(rays, n, hits.data());
+	thread_rays += n;
+
+	TileShader shader(bounds);
+	for (int i=0; i!=n; i++)
+		if (hits[i].surface != NULL)
+			nodes[i] = shader.add(rays[i], hits[i].t<0.001? hits[i].t_max: hits[i].t, hits[i], pixel_sampler(rays[i], pass));
+	shader.run();
+	for (int i=0; i!=n; i++)
+		if (hits[i].surface != NULL)
+			img(rays[i].r, rays[i].c) = shader.color(nodes[i]);
+}
+
+/**
+ * Traces the primary rays of the viewing window into img. Its rectangle
+ * is cut into tiles of options.packet pixels square (RENDER_TILE without
+ * packets), which are spread over options.threads threads.
+ * @param vw   The viewing window
+ * @param img  The image
+ * @param pass The pass over the image, for the samplers
+ */
+void trace_primary(ViewWindow& vw, Image& img, int pass) {
+	std::vector<int> starts = sort_into_tiles(vw.all_rays, options.packet>1? options.packet: RENDER_TILE, vw.rect);
+	AABB bounds = accel->get_bounds();
+	primary_count += starts.back();
+	parallel_for(starts.size()-1, thread_count(options.threads), [&](int k, int) {
+		trace_tile(&vw.all_rays[starts[k]], starts[k+1]-starts[k], img, bounds, pass);
+		ray_count += thread_rays;
+		shadow_count += thread_shadow_rays;
+		thread_rays = thread_shadow_rays = 0;
+	});
+}
+
+/**
+ * Renders the scene into img with depth of field.
+ * @param img    The image, filled with the background color
+ * @param sample The progressive pass, each draws other random numbers
+ * @param rect   The pixels to render
+ */
+void render(Image& img, int sample, const Rect& rect) {
+	/* Create the viewing window */
+	ViewWindow vw(params, rect);
+
+	/* Fill the image with the nearest ray intersection points */
 	int bundle_size=1; // set to 1 for no depth of field
-	int d = vw.d, count = 1;
+	int pass = sample*(bundle_size+1);
+	trace_primary(vw, img, pass);
+
+	/* implement depth of field */
+	int d = vw.d;
 	Vec3 eye = params.eye;
-	for (; count<=bundle_size; count++) {
-		Vec3 jitter(RANDN(), RANDN(), RANDN());
+	Sampler lens(options.seed, LENS_STREAM - sample);
+	for (int count=1; count<=bundle_size; count++) {
+		float x = lens.normal(), y = lens.normal(), z = lens.normal();
+		Vec3 jitter(x, y, z);
 		params.eye = eye + (.009*d*jitter);
-		vw = ViewWindow(params);
+		vw = ViewWindow(params, rect);
+		trace_primary(vw, img, pass+count);
+	}
+	params.eye = eye;
+}
 
-		for (Ray& ray : vw.all_rays) {
-			float alpha;
-			Surface *s = trace_ray(ray, alpha);
-			if (s != NULL)
-				img(ray.r, ray.c) = get_color(ray, alpha, s);
+/**
+ * The checkpoint file of an image
+ * @param  fn The name of the image
+ * @return    The name of the checkpoint
+ */
+std::string checkpoint_path(std::string fn) {
+	return remove_ext(fn) + ".ckpt";
+}
+
+/**
+ * The pixels to render: options.crop, or the whole image without --crop
+ * @return The rectangle
+ */
+Rect frame_rect() {
+	if (options.crop.x1 > options.crop.x0)
+		return options.crop;
+	return Rect{0, 0, params.width, params.height};
+}
+
+/**
+ * Cuts a rectangle into tiles of CHECKPOINT_TILE pixels square, row by row
+ * @param  rect The rectangle
+ * @return      The tiles
+ */
+std::vector<Rect> pass_tiles(const Rect& rect) {
+	std::vector<Rect> tiles;
+	for (int y=rect.y0; y<rect.y1; y+=CHECKPOINT_TILE)
+		for (int x=rect.x0; x<rect.x1; x+=CHECKPOINT_TILE)
+			tiles.push_back(Rect{x, y, std::min(x+CHECKPOINT_TILE, rect.x1), std::min(y+CHECKPOINT_TILE, rect.y1)});
+	return tiles;
+}
+
+/**
+ * The order to render the tiles of a pass in, by options.tile_order:
+ * row by row, in a spiral out from the center of the rectangle, or the
+ * tiles where the importance mask options.mask is brightest first. The
+ * mask is stretched over the whole image.
+ * @param  tiles The tiles, row by row
+ * @param  rect  The rectangle they cover
+ * @return       The indices of the tiles in the order to render them
+ */
+std::vector<int> tile_order(const std::vector<Rect>& tiles, const Rect& rect) {
+	std::vector<int> order(tiles.size());
+	for (size_t i=0; i!=tiles.size(); i++)
+		order[i] = i;
+	if (options.tile_order == TILE_SCANLINE)
+		return order;
+
+	/* the spiral goes ring by ring, around each ring by angle */
+	std::vector<std::pair<float, float> > key(tiles.size());
+	float cx = 0.5*(rect.x0 + rect.x1), cy = 0.5*(rect.y0 + rect.y1);
+	for (size_t i=0; i!=tiles.size(); i++) {
+		float dx = (0.5*(tiles[i].x0 + tiles[i].x1) - cx)/CHECKPOINT_TILE;
+		float dy = (0.5*(tiles[i].y0 + tiles[i].y1) - cy)/CHECKPOINT_TILE;
+		key[i] = std::make_pair(roundf(std::max(fabsf(dx), fabsf(dy))), atan2f(dy, dx));
+	}
+	if (options.tile_order == TILE_MASK) {
+		Texture mask(options.mask);
+		for (size_t i=0; i!=tiles.size(); i++) {
+			Color sum(0.0, 0.0, 0.0);
+			for (int r=tiles[i].y0; r!=tiles[i].y1; r++)
+				for (int c=tiles[i].x0; c!=tiles[i].x1; c++)
+					sum = sum + mask((c+0.5)/params.width, (r+0.5)/params.height);
+			float pixels = (tiles[i].x1-tiles[i].x0)*(tiles[i].y1-tiles[i].y0);
+			key[i].first = -(sum.r + sum.g + sum.b)/pixels;
 		}
+	}
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return key[a] < key[b]; });
+	return order;
+}
+
+/**
+ * Renders the scene up to passes times and averages the passes into img.
+ * Every pass draws new random numbers, so depth of field and soft shadows
+ * converge as the passes add up. A pass is rendered in tiles of
+ * CHECKPOINT_TILE pixels square, in the order of tile_order, and every
+ * tile is added into the average when it is done, so the important tiles
+ * converge first. Every options.snapshot_passes passes or
+ * options.snapshot_seconds seconds, whichever comes first, the average so
+ * far is written to <name>_preview.ppm so a long job can be stopped once
+ * the preview is good enough. A tile is only started if it should end by
+ * the deadline, going by the time the last one took, or before any tile
+ * is done by its share of pass_time. Pixels of tiles that were never
+ * rendered keep what img held. With checkpoint, the state of the render
+ * is written to <name>.ckpt every options.checkpoint_seconds seconds,
+ * after the tile that ends them, and with options.resume a render is
+ * continued from that file if there is one. The image is the same as one
+ * rendered without stopping.
+ * @param  img        The image, filled with the background color or with
+ *                    a render the passes replace
+ * @param  fn         The name of the final image
+ * @param  passes     The number of passes
+ * @param  checkpoint If the render can be checkpointed and resumed
+ * @param  deadline   When the last tile has to end
+ * @param  pass_time  The time a pass is expected to take, for the tiles
+ *                    started before one was timed. 0 if unknown
+ * @return            The number of whole passes rendered
+ */
+int render_progressive(Image& img, std::string fn, int passes, bool checkpoint=false,
+											 std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point::max(),
+											 std::chrono::steady_clock::duration pass_time=std::chrono::steady_clock::duration(0)) {
+	std::string preview = remove_ext(fn) + "_preview.ppm";
+	std::string path = checkpoint_path(fn);
+	Rect rect = frame_rect();
+	std::vector<Rect> tiles = pass_tiles(rect);
+	std::vector<int> order = tile_order(tiles, rect);
+	size_t pixels = img.image.size();
+	double rect_pixels = (double) (rect.x1-rect.x0)*(rect.y1-rect.y0);
+	Checkpoint state;
+	state.scene = checkpoint? file_hash(options.filename): 0;
+	state.seed = options.seed;
+	state.width = params.width; state.height = params.height;
+	state.depth = options.depth; state.shadow_bundle = options.shadow_bundle;
+	state.passes = passes;
+	state.rect = rect;
+	state.sample = 0;
+	state.tiles.assign(tiles.size(), 0);
+	state.counts.assign(pixels, 0);
+	state.sum.assign(pixels, Color(0.0, 0.0, 0.0));
+
+	/* the average of the rectangle so far */
+	auto average = [&]() {
+		for (int r=rect.y0; r!=rect.y1; r++)
+			for (int c=rect.x0; c!=rect.x1; c++) {
+				size_t i = (size_t) r*params.width + c;
+				if (state.counts[i] > 0)
+					img.image[i] = state.sum[i]/(float) state.counts[i];
+			}
+	};
 
+	if (checkpoint && options.resume) {
+		Checkpoint saved;
+		if (saved.load(path)) {
+			if (!saved.matches(state))
+				throw checkpoint_error(path + " is of another scene or other options");
+			state = saved;
+			printf("Resuming from %s at pass %i/%i\n", path.c_str(), state.sample+1, passes);
+			average();
+		}
 	}
-	for (Color& c : img.image)
-		c = c/(float) count;
 
+	auto snapshot = std::chrono::steady_clock::now(), saved = snapshot;
+	std::chrono::steady_clock::duration tile_time(0);
+	bool timed = false; // if tile_time was measured
+	int rendered;
+	for (rendered=0; state.sample!=passes; rendered++) {
+		Image pass(params.width, params.height, params.bkg_color);
+		for (int k : order) {
+			if (state.tiles[k])
+				continue;
+			const Rect& tile = tiles[k];
+			auto tile_start = std::chrono::steady_clock::now();
+			if (!timed)
+				tile_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					pass_time*((tile.x1-tile.x0)*(tile.y1-tile.y0)/rect_pixels));
+			if (deadline - tile_start < tile_time) {
+				average();
+				return rendered;
+			}
+			render(pass, state.sample, tile);
+			for (int r=tile.y0; r!=tile.y1; r++)
+				for (int c=tile.x0; c!=tile.x1; c++) {
+					size_t i = (size_t) r*params.width + c;
+					state.sum[i] = state.sum[i] + pass.image[i];
+					state.counts[i]++;
+				}
+			state.tiles[k] = 1;
 
-	/* save the image */
-	std::string fn = remove_ext(filename) + ".ppm";
-	img.save(fn);
+			auto now = std::chrono::steady_clock::now();
+			tile_time = now - tile_start;
+			timed = true;
+			std::chrono::duration<double> since = now - saved;
+			if (checkpoint && options.checkpoint_seconds > 0.0 && since.count() >= options.checkpoint_seconds) {
+				try {
+					state.save(path);
+					printf("Pass %i/%i: wrote %s\n", state.sample+1, passes, path.c_str());
+				} catch (std::exception& e) {
+					std::cout << e.what() << std::endl; // the render goes on, it only cannot be resumed
+				}
+				saved = std::chrono::steady_clock::now();
+			}
+			since = now - snapshot;
+			if (passes > 1 && options.snapshot_seconds > 0.0 && since.count() >= options.snapshot_seconds) {
+				average();
+				img.crop(rect).save_atomic(preview);
+				printf("Pass %i/%i: wrote %s\n", state.sample+1, passes, preview.c_str());
+				snapshot = std::chrono::steady_clock::now();
+			}
+		}
+		state.sample++;
+		state.tiles.assign(state.tiles.size(), 0);
+		average();
+
+		if (state.sample != passes && options.snapshot_passes > 0 && state.sample%options.snapshot_passes == 0) {
+			img.crop(rect).save_atomic(preview);
+			printf("Pass %i/%i: wrote %s\n", state.sample, passes, preview.c_str());
+			snapshot = std::chrono::steady_clock::now();
+		}
+	}
+	return rendered;
+}
 
-	/* clean-up */
+/**
+ * The rays of a pass at other settings, predicted from a pass at depth 1
+ * with one shadow ray per light. A chain of reflections or refractions is
+ * as long as the depth, so the rays after the primary ones grow linearly
+ * with it, and the shadow rays grow with the rays that hit something.
+ * @param  primary The primary rays of the measured pass
+ * @param  traced  The rays it traced apart from the shadow rays
+ * @param  shadow  The shadow rays it traced
+ * @param  depth   The depth of reflections and refractions
+ * @param  bundle  The shadow rays per point light
+ * @return         The rays predicted
+ */
+double predict_rays(double primary, double traced, double shadow, int depth, int bundle) {
+	double rays = primary + (traced - primary)*depth;
+	return rays + (traced > 0.0? shadow*rays/traced*bundle: 0.0);
+}
+
+/**
+ * Renders the scene within options.time_budget seconds. A first pass at
+ * depth 1 with hard shadows measures the throughput and the rays the scene
+ * takes, and is the image if nothing better fits. The settings are then
+ * picked in order of how much they add: the depth of reflections and
+ * refractions up to options.depth as long as one pass fits, then the
+ * shadow rays per point light up to options.shadow_bundle
+ * (BUDGET_MAX_BUNDLE if it is 1) as long as BUDGET_MIN_PASSES passes fit,
+ * then as many passes as fit, up to options.passes (BUDGET_MAX_PASSES if
+ * it is 1). The passes are rendered with render_progressive, which goes by
+ * the time the passes actually take, so it renders more of them if the
+ * prediction was high and stops early if it was low, even within the first
+ * of them: the tiles it did not get to keep the first pass. The image is
+ * ready by the deadline unless the first pass alone takes longer.
+ * @param img The image, filled with the background color
+ * @param fn  The name of the final image
+ */
+void render_budget(Image& img, std::string fn) {
+	auto start = std::chrono::steady_clock::now();
+	int max_depth = options.depth, shadow_bundle = options.shadow_bundle;
+	int max_bundle = shadow_bundle > 1? shadow_bundle: BUDGET_MAX_BUNDLE;
+	int max_passes = options.passes > 1? options.passes: BUDGET_MAX_PASSES;
+
+	/* the first pass, at the cheapest settings */
+	options.depth = std::min(max_depth, 1);
+	options.shadow_bundle = 1;
+	long long rays = ray_count, shadow = shadow_count, primary = primary_count;
+	render(img, 0, frame_rect());
+	rays = ray_count - rays; shadow = shadow_count - shadow; primary = primary_count - primary;
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::duration<double> took = now - start;
+	double throughput = rays/std::max(took.count(), 1e-6);
+	double plan = (options.time_budget - took.count())*BUDGET_MARGIN;
+
+	/* pick the settings, best first */
+	bool point = false;
+	for (LightSource *source : lights)
+		point |= source->w != 0.0;
+	auto pass_time = [&](int depth, int bundle) {
+		return predict_rays(primary, rays-shadow, shadow, depth, bundle)/throughput;
+	};
+	int depth = options.depth, bundle = 1;
+	while (depth < max_depth && pass_time(depth+1, bundle) <= plan)
+		depth++;
+	while (point && bundle*2 <= max_bundle && pass_time(depth, bundle*2)*BUDGET_MIN_PASSES <= plan)
+		bundle *= 2;
+	int passes = (int) std::min((double) max_passes, plan/pass_time(depth, bundle));
+
+	printf("Time budget: first pass %.3f s (%.3f Mrays/s), depth %i, shadow bundle %i, %i passes planned\n",
+		took.count(), throughput/1e6, depth, bundle, passes);
+	if (passes > 0) {
+		options.depth = depth;
+		options.shadow_bundle = bundle;
+		auto seconds = [](double s) {
+			return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(s));
+		};
+		/* the passes replace the first one tile by tile */
+		passes = render_progressive(img, fn, max_passes, false, now + seconds(plan), seconds(pass_time(depth, bundle)));
+		printf("Time budget: %i passes rendered\n", passes);
+	}
+	options.depth = max_depth;
+	options.shadow_bundle = shadow_bundle;
+}
+
+/**
+ * Moves the scene to an animation frame. Only the vertices move, so the
+ * trees are refit instead of built again.
+ * @param frame The frame, 1 for the first of Surface::frames
+ */
+void set_frame(size_t frame) {
+	auto refit_start = std::chrono::steady_clock::now();
+	Surface::vertex_array = Surface::frames[frame-1];
+	int rebuilt = 0;
+	for (Mesh *mesh : meshes)
+		rebuilt += mesh->refit();
+	for (Surface *surface : surfaces)
+		surface->update_vertices();
+	rebuilt += accel->refit();
+	std::chrono::duration<double, std::milli> refit_time = std::chrono::steady_clock::now() - refit_start;
+	printf("Frame %zu: refit time: %.3f ms, %i structures rebuilt\n", frame, refit_time.count(), rebuilt);
+}
+
+/**
+ * The pixels of a farm job: FARM_BAND rows per band, cut to frame_rect
+ * @param  job The job
+ * @return     The rectangle
+ */
+Rect band_rect(const FarmJob& job) {
+	Rect rect = frame_rect();
+	return Rect{rect.x0, std::max(job.first*FARM_BAND, rect.y0), rect.x1, std::min(job.last*FARM_BAND, rect.y1)};
+}
+
+/**
+ * Renders a farm job in a worker. The result is the number of rays traced
+ * followed by the pixels of the job, row by row.
+ * @param  job The job
+ * @return     The result for the coordinator
+ */
+std::vector<char> render_job(const FarmJob& job) {
+	static int frame = 0; // the frame the scene is at, jobs never go back
+	while (frame < job.frame)
+		set_frame(++frame);
+
+	Rect rect = band_rect(job);
+	Image img(params.width, params.height, params.bkg_color);
+	ray_count = 0;
+	render(img, 0, rect);
+
+	long long rays = ray_count;
+	size_t pixels = (size_t) (rect.y1-rect.y0)*params.width;
+	std::vector<char> result(sizeof(rays) + pixels*sizeof(Pixel));
+	memcpy(result.data(), &rays, sizeof(rays));
+	memcpy(result.data() + sizeof(rays), &img.image[(size_t) rect.y0*params.width], pixels*sizeof(Pixel));
+	return result;
+}
+
+/**
+ * Renders a frame on the farm: the image is cut into jobs of FARM_JOB
+ * bands, the workers render them and the results are copied into img.
+ * The jobs left when no worker is left are rendered here.
+ * @param farm  The farm
+ * @param img   The image, filled with the background color
+ * @param frame The frame
+ */
+void render_farm(Farm& farm, Image& img, int frame) {
+	std::vector<FarmJob> jobs;
+	int first = frame_rect().y0/FARM_BAND, bands = (frame_rect().y1 + FARM_BAND-1)/FARM_BAND;
+	for (int b=first; b<bands; b+=FARM_JOB)
+		jobs.push_back(FarmJob{frame, b, std::min(b+FARM_JOB, bands)});
+
+	std::vector<FarmJob> left = farm.run(jobs, [&](const FarmJob& job, const std::vector<char>& result) {
+		Rect rect = band_rect(job);
+		size_t pixels = (size_t) (rect.y1-rect.y0)*params.width;
+		long long rays;
+		if (result.size() != sizeof(rays) + pixels*sizeof(Pixel))
+			return false;
+		memcpy(&rays, result.data(), sizeof(rays));
+		memcpy(&img.image[(size_t) rect.y0*params.width], result.data() + sizeof(rays), pixels*sizeof(Pixel));
+		ray_count += rays;
+		return true;
+	});
+
+	if (!left.empty())
+		printf("Farm: no worker left, rendering %zu jobs here\n", left.size());
+	for (const FarmJob& job : left)
+		render(img, 0, band_rect(job));
+}
+
+/**
+ * The command line of a worker: the one of this process without --farm,
+ * with the socket of the coordinator. The program is /proc/self/exe so
+ * that the workers run the same binary wherever it was started from.
+ * @param  argc The number of arguments
+ * @param  argv The arguments
+ * @param  path The socket of the coordinator
+ * @return      The arguments of the worker
+ */
+std::vector<std::string> worker_args(int argc, char *argv[], std::string path) {
+	std::vector<std::string> args(1, "/proc/self/exe");
+	for (int i=1; i<argc; i++) {
+		if (std::string(argv[i]) == "--farm") {
+			i++;
+			continue;
+		}
+		args.push_back(argv[i]);
+	}
+	args.push_back("--worker");
+	args.push_back(path);
+	return args;
+}
+
+/**
+ * Makes an empty acceleration structure
+ * @param  type    The kind of structure
+ * @param  builder The BVH builder, for ACCEL_BVH
+ * @param  layout  The BVH node layout, for ACCEL_BVH
+ * @return         The structure, to be deleted by the caller
+ */
+Accelerator* new_accelerator(AccelType type, BVHBuilder builder, BVHLayout layout) {
+	switch (type) {
+	case ACCEL_GRID:
+		return new Grid(1);
+	case ACCEL_TWO_LEVEL_GRID:
+		return new Grid(2);
+	case ACCEL_BRUTE_FORCE:
+		return new BruteForce();
+	default:
+		return new BVH(builder, layout);
+	}
+}
+
+/**
+ * Traces packets of rays for the benchmark until all were traced
+ * BENCHMARK_PASSES times or BENCHMARK_SECONDS went by. Packets of one ray
+ * are traced with closest_hit.
+ * @param  a         The structure
+ * @param  rays      The rays
+ * @param  starts    The index in rays where each packet starts, and rays.size()
+ * @param  out_hits  The number of rays that hit a surface
+ * @param  out_rays  The number of rays traced
+ * @return           The time taken in seconds
+ */
+double benchmark_trace(Accelerator *a, std::vector<Ray>& rays, const std::vector<int>& starts, long long& out_hits,
+											 long long& out_rays) {
+	std::vector<Hit> hits(rays.size());
+	out_hits = out_rays = 0;
+	auto start = std::chrono::steady_clock::now();
+	std::chrono::duration<double> time(0.0);
+	for (int pass=0; pass!=BENCHMARK_PASSES && time.count()<BENCHMARK_SECONDS; pass++)
+		for (size_t k=0; k+1<starts.size() && time.count()<BENCHMARK_SECONDS; k++) {
+			int i = starts[k], n = starts[k+1] - starts[k];
+			if (n == 1)
+				a->closest_hit(rays[i], hits[i]);
+			else
+				a->closest_hits(&rays[i], n, &hits[i]);
+			for (int j=i; j!=i+n; j++)
+				out_hits += hits[j].surface != NULL;
+			/* look at the clock every 1024 rays or so */
+			if ((out_rays+n)/1024 != out_rays/1024)
+				time = std::chrono::steady_clock::now() - start;
+			out_rays += n;
+		}
+	time = std::chrono::steady_clock::now() - start;
+	return time.count();
+}
+
+/**
+ * Compares the acceleration structures on the scene: builds each of them
+ * and reports the build time, the memory used and how fast the closest
+ * hits of the primary rays are found, one by one and in tiles of
+ * options.packet pixels square (8 if packets are off). Meshes always use
+ * a BVH, in the layout of the structure or the one given.
+ */
+void benchmark() {
+	struct { const char *name; AccelType type; BVHLayout layout; } runs[] = {
+		{"bvh", ACCEL_BVH, BVH_FLOAT},
+		{"bvh-quant", ACCEL_BVH, BVH_QUANTIZED},
+		{"grid", ACCEL_GRID, options.layout},
+		{"grid2", ACCEL_TWO_LEVEL_GRID, options.layout},
+		{"brute", ACCEL_BRUTE_FORCE, options.layout},
+	};
+	ViewWindow vw(params);
+	std::vector<Ray> tiled = vw.all_rays;
+	std::vector<int> singles, tiles = sort_into_tiles(tiled, options.packet>1? options.packet: 8,
+																										Rect{0, 0, params.width, params.height});
+	for (size_t i=0; i<=vw.all_rays.size(); i++)
+		singles.push_back(i);
+
+	for (auto& run : runs) {
+		auto build_start = std::chrono::steady_clock::now();
+		for (Mesh *mesh : meshes)
+			mesh->build(options.builder, run.layout);
+		Accelerator *a = new_accelerator(run.type, options.builder, run.layout);
+		a->build(surfaces);
+		std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - build_start;
+		size_t bytes = a->memory();
+		for (Mesh *mesh : meshes)
+			bytes += mesh->bvh.memory();
+
+		long long hits, rays, packet_hits, packet_rays;
+		double time = benchmark_trace(a, vw.all_rays, singles, hits, rays);
+		double packet_time = benchmark_trace(a, tiled, tiles, packet_hits, packet_rays);
+		printf("%-10s build: %9.3f ms  memory: %10zu bytes  %8.3f Mrays/s  packets: %8.3f Mrays/s  hits: %lld of %lld\n",
+			run.name, build_time.count(), bytes, rays/time/1e6, packet_rays/packet_time/1e6, hits, rays);
+		delete a;
+	}
+}
+
+/**
+ * Frees the scene, so that another one can be read. The textures stay in
+ * texture_cache.
+ */
+void clean_up() {
 	for (LightSource *source : lights)
 		delete source;
 	for (Surface *surface : surfaces)
 		delete surface;
-	for (Texture *texture : textures)
-		delete texture;
+	for (Mesh *mesh : meshes)
+		delete mesh;
+	delete accel;
+	lights.clear(); surfaces.clear(); textures.clear(); meshes.clear();
+	accel = NULL;
+	Surface::vertex_array.clear(); Surface::u_array.clear(); Surface::v_array.clear();
+	Surface::n_array.clear(); Surface::frames.clear();
+}
+
+/**
+ * Prints how to run the program
+ */
+void usage() {
+	printf("usage: ./main [--accel bvh|grid|grid2|brute] [--builder sah|binned] [--layout float|quantized]\n"
+				 "              [--packet 0|8|16] [--threads n] [--seed n] [--passes n] [--snapshot-every n]\n"
+				 "              [--snapshot-seconds s] [--depth n] [--shadow-bundle n] [--time-budget s]\n"
+				 "              [--checkpoint-seconds s] [--resume] [--crop x0 y0 x1 y1] [--tile-order scanline|spiral|mask]\n"
+				 "              [--mask file] [--farm n] [--worker socket] [--benchmark] <input-file>\n"
+				 "       ./main [options] --batch <job-list>\n");
+}
+
+/**
+ * Reads the scene of options.filename, renders every frame of it, runs
+ * its benchmark or works for a farm, as the options say, and frees it.
+ * @param  argc   The number of arguments of the job
+ * @param  argv   The arguments, for the farm workers
+ * @param  writer Saves the images
+ * @return        0, or -1 if the scene could not be read or rendered
+ */
+int run_job(int argc, char *argv[], ImageWriter& writer) {
+	/* Get image parameters */
+	try {
+		params = parse_input(options.filename, surfaces, lights, textures, meshes, texture_cache);
+		if (options.crop.x1 > params.width || options.crop.y1 > params.height)
+			throw invalid_option("--crop: the rectangle is not inside the image");
+	} catch (std::exception& e) {
+		std::cout << e.what() << std::endl;
+		clean_up();
+		return -1;
+	}
+
+	/* Build the acceleration structures, meshes first as instances need their bounds */
+	auto build_start = std::chrono::steady_clock::now();
+	for (Mesh *mesh : meshes)
+		mesh->build(options.builder, options.layout);
+	accel = new_accelerator(options.accel, options.builder, options.layout);
+	accel->build(surfaces);
+	std::chrono::duration<double, std::milli> build_time = std::chrono::steady_clock::now() - build_start;
+	for (Mesh *mesh : meshes)
+		mesh->print();
+	for (Surface *s : surfaces)
+		if (s->type == 5)
+			s->print();
+	accel->print();
+	if (options.accel == ACCEL_BVH)
+		printf("BVH build time (%s): %.3f ms\n", options.builder==BVH_BINNED? "binned": "sah", build_time.count());
+	else
+		printf("Build time: %.3f ms\n", build_time.count());
+
+	if (options.benchmark) {
+		benchmark();
+		clean_up();
+		return 0;
+	}
+
+	if (options.worker != "") {
+		try {
+			farm_worker(options.worker, render_job);
+		} catch (std::exception& e) {
+			std::cout << e.what() << std::endl;
+		}
+		clean_up();
+		return 0;
+	}
+
+	Farm *farm = NULL;
+	if (options.farm > 0) {
+		std::string path = "/tmp/rt4-" + std::to_string(getpid()) + ".sock";
+		try {
+			farm = new Farm(path);
+			farm->spawn(options.farm, worker_args(argc, argv, path));
+		} catch (std::exception& e) {
+			std::cout << e.what() << std::endl;
+			delete farm;
+			clean_up();
+			return -1;
+		}
+		printf("Farm: %i workers, more can join with --worker %s\n", options.farm, path.c_str());
+	}
+
+	/* the scene as read, then every animation frame, each to its own image */
+	for (size_t frame=0; frame<=Surface::frames.size(); frame++) {
+		std::string fn = remove_ext(options.filename) + ".ppm";
+		if (!Surface::frames.empty()) {
+			char suffix[16];
+			snprintf(suffix, sizeof(suffix), "_%04zu.ppm", frame);
+			fn = remove_ext(options.filename) + suffix;
+		}
+
+		if (frame > 0)
+			set_frame(frame);
 
+		Image img(params.width, params.height, params.bkg_color);
+		ray_count = 0;
+		auto render_start = std::chrono::steady_clock::now();
+		if (farm)
+			render_farm(*farm, img, frame);
+		else if (options.time_budget > 0.0)
+			render_budget(img, fn);
+		else {
+			try {
+				render_progressive(img, fn, options.passes, true);
+			} catch (std::exception& e) {
+				std::cout << e.what() << std::endl;
+				delete farm;
+				clean_up();
+				return -1;
+			}
+		}
+		std::chrono::duration<double> render_time = std::chrono::steady_clock::now() - render_start;
+		printf("Render time: %.3f s, %lld rays (%.3f Mrays/s), threads: %i\n", render_time.count(), ray_count.load(),
+			ray_count/render_time.count()/1e6, thread_count(options.threads));
+
+		/* save the image while the next frame renders, the checkpoint is not needed once it is written */
+		writer.push(options.crop.x1 > options.crop.x0? img.crop(options.crop): std::move(img), fn, checkpoint_path(fn));
+	}
+
+	delete farm;
+	clean_up();
 	return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Runs the jobs of options.batch one after another in this process, so
+ * the threads, the decoded textures and the image writer are set up once
+ * and every image is written while the next job renders. A job is a line
+ * of options and a scene file, added to the command line without
+ * --batch. Empty lines and lines starting with '#' are skipped. A job
+ * that fails does not stop the others. The summary is printed once every
+ * image is written.
+ * @param  argc   The number of arguments
+ * @param  argv   The arguments
+ * @param  writer Saves the images
+ * @return        0, or -1 if a job failed
+ */
+int run_batch(int argc, char *argv[], ImageWriter& writer) {
+	std::ifstream in(options.batch.c_str());
+	if (!in.is_open()) {
+		std::cout << invalid_file(options.batch).what() << std::endl;
+		return -1;
+	}
+	std::vector<std::string> base(1, argv[0]);
+	for (int i=1; i<argc; i++) {
+		if (std::string(argv[i]) == "--batch") {
+			i++;
+			continue;
+		}
+		base.push_back(argv[i]);
+	}
+
+	std::string line;
+	int jobs = 0, failed = 0;
+	while (std::getline(in, line)) {
+		std::stringstream ss(line);
+		std::vector<std::string> args = base;
+		std::string arg;
+		while (ss >> arg)
+			args.push_back(arg);
+		if (args.size() == base.size() || args[base.size()][0] == '#')
+			continue;
+
+		printf("Job %i: %s\n", ++jobs, line.c_str());
+		std::vector<char*> job_argv;
+		for (std::string& a : args)
+			job_argv.push_back(const_cast<char*>(a.c_str()));
+		try {
+			options = parse_args(job_argv.size(), job_argv.data());
+			if (options.batch != "" || options.farm > 0 || options.worker != "")
+				throw invalid_option("--batch, --farm or --worker in a job");
+		} catch (std::exception& e) {
+			std::cout << e.what() << std::endl;
+			failed++;
+			continue;
+		}
+		if (run_job(job_argv.size(), job_argv.data(), writer) != 0)
+			failed++;
+	}
+	writer.flush();
+	printf("Batch: %i jobs, %i failed\n", jobs, failed);
+	return failed? -1: 0;
+}
+
+int main(int argc, char *argv[]) {
+	/* Basic input validation */
+	try {
+		options = parse_args(argc, argv);
+	} catch (std::exception& e) {
+		std::cout << e.what() << std::endl;
+		usage();
+		exit(1);
+	}
+
+	/* the writer outlives the jobs, its destructor flushes it */
+	ImageWriter writer(WRITER_QUEUE);
+	if (options.batch != "")
+		return run_batch(argc, argv, writer);
+	return run_job(argc, argv, writer);
+}
@@ -0,0 +1,45 @@
+#ifndef _OPTIONS_H
+#define _OPTIONS_H
+
+#include <string>
+
+#include "bvh.hpp"
+#include "image.hpp"
+
+/** The order in which the tiles of a pass are rendered */
+enum TileOrder { TILE_SCANLINE, TILE_SPIRAL, TILE_MASK };
+
+/**
+ * A structure to hold the options given on the command line.
+ */
+struct Options {
+	std::string filename;
+	AccelType accel;
+	BVHBuilder builder;
+	BVHLayout layout;
+	int packet; // side of the tiles of primary rays traced together, 0 for none
+	int threads; // threads to render with, 0 for all cores
+	unsigned long long seed; // key of the random number streams
+	int passes; // progressive passes averaged into the image, 1 for a single render
+	int snapshot_passes; // write a preview every this many passes, 0 for never
+	double snapshot_seconds; // or after this many seconds, 0 for never
+	int depth; // depth of reflections and refractions
+	int shadow_bundle; // shadow rays per point light, 1 for hard shadows
+	double time_budget; // seconds a frame may take, 0 for no budget
+	double checkpoint_seconds; // write a checkpoint this often, 0 for never
+	bool resume; // continue from the checkpoint of a stopped render
+	Rect crop; // the pixels to render, all if it is empty
+	TileOrder tile_order;
+	std::string mask; // the importance mask of TILE_MASK
+	int farm; // worker processes to render with, 0 to render in this process
+	std::string worker; // the socket of the coordinator when this process is a worker
+	std::string batch; // the job list, one command line per job
+	bool benchmark;
+
+	Options() : accel(ACCEL_BVH), builder(BVH_SAH), layout(BVH_FLOAT), packet(8), threads(0), seed(0), passes(1),
+							snapshot_passes(0), snapshot_seconds(10.0), depth(5), shadow_bundle(1),
+							time_budget(0.0), checkpoint_seconds(60.0), resume(false), crop(Rect{0, 0, 0, 0}),
+							tile_order(TILE_SCANLINE), farm(0), benchmark(false) {}
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "rayqueue.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#define QUEUE_CELL_BITS 8	// the origin grid has 2^bits cells per axis
+#define QUEUE_BATCH 64		// most rays traced together
+
+/**
+ * Spreads the low 10 bits of v so that two zero bits follow each of them,
+ * for interleaving three coordinates into a Morton code.
+ * @param  v The coordinate
+ * @return   The spread bits
+ */
+static inline unsigned spread_bits(unsigned v) {
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+/**
+ * @constructor
+ * @param bounds The box of the scene, for the origin grid
+ */
+RayQueue::RayQueue(const AABB& bounds) : bounds(bounds) {}
+
+/**
+ * The sort key of a ray: the octant of its direction in the top bits and
+ * the Morton code of its origin cell below. Origins outside the box are
+ * put in the nearest cell. The octant uses the sign bit so that -0.0 goes
+ * with the negative directions, like the slab tests.
+ * @param  ray The ray
+ * @return     The key
+ */
+unsigned RayQueue::key(const Ray& ray) {
+	const float org[3] = {ray.org.x, ray.org.y, ray.org.z};
+	const float dir[3] = {ray.dir.x, ray.dir.y, ray.dir.z};
+	const float lo[3] = {bounds.lo.x, bounds.lo.y, bounds.lo.z};
+	const float hi[3] = {bounds.hi.x, bounds.hi.y, bounds.hi.z};
+	const int cells = 1 << QUEUE_CELL_BITS;
+	unsigned octant = 0, morton = 0;
+	for (int axis=0; axis!=3; axis++) {
+		octant |= (unsigned) std::signbit(dir[axis]) << axis;
+		float ext = hi[axis] - lo[axis];
+		float f = ext > 0.0? (org[axis] - lo[axis])/ext*cells: 0.0;
+		int c = !(f >= 0.0)? 0: (f >= cells? cells-1: (int) f); // NaN goes to cell 0
+		morton |= spread_bits(c) << axis;
+	}
+	return octant << (3*QUEUE_CELL_BITS) | morton;
+}
+
+/**
+ * Adds a ray to the queue
+ * @param ray The ray, with its origin already offset from the surface
+ */
+void RayQueue::push(const Ray& ray) {
+	rays.push_back(ray);
+}
+
+/**
+ * If there are no rays in the queue
+ * @return true if the queue is empty
+ */
+bool RayQueue::empty() {
+	return rays.empty();
+}
+
+/**
+ * Traces all queued rays with closest_hits in batches of at most
+ * QUEUE_BATCH rays of the same octant, and empties the queue. Ties in the
+ * sort keep the order of the pushes.
+ * @param accel    The structure to trace the rays with
+ * @param out_rays The rays, in the order they were pushed
+ * @param out_hits The closest hit of each ray, with a NULL surface if none
+ */
+void RayQueue::trace(Accelerator *accel, std::vector<Ray>& out_rays, std::vector<Hit>& out_hits) {
+	size_t n = rays.size();
+	std::vector<std::pair<unsigned, int> > order(n);
+	for (size_t i=0; i!=n; i++)
+		order[i] = std::make_pair(key(rays[i]), (int) i);
+	std::sort(order.begin(), order.end());
+
+	std::vector<Ray> sorted;
+	sorted.reserve(n);
+	for (auto& o : order)
+		sorted.push_back(rays[o.second]);
+	std::vector<Hit> hits(n);
+	for (size_t start=0, end; start<n; start=end) {
+		unsigned octant = order[start].first >> (3*QUEUE_CELL_BITS);
+		for (end=start+1; end!=n && end-start<QUEUE_BATCH && order[end].first >> (3*QUEUE_CELL_BITS) == octant; end++);
+		accel->closest_hits(&sorted[start], end-start, &hits[start]);
+	}
+
+	/* scatter the hits back to the order of the pushes */
+	out_hits.resize(n);
+	for (size_t k=0; k!=n; k++)
+		out_hits[order[k].second] = hits[k];
+	out_rays.swap(rays);
+	rays.clear();
+}
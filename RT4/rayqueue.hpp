@@ -0,0 +1,31 @@
+#ifndef _RAYQUEUE_HPP
+#define _RAYQUEUE_HPP
+
+#include <vector>
+
+#include "accel.hpp"
+#include "geometry.hpp"
+#include "surfaces.hpp"
+
+/**
+ * RayQueue collects incoherent rays, like the reflected and refracted rays
+ * of a tile, and traces them in coherent batches. The rays are sorted by
+ * the octant of their direction and then by the cell of their origin on a
+ * grid over the scene, along a Morton curve, so that each batch holds rays
+ * that start close together and point the same way. The hits are given
+ * back in the order the rays were pushed.
+ * 	push:	adds a ray to the queue
+ * 	trace:	traces all queued rays and empties the queue
+ */
+class RayQueue {
+	AABB bounds;
+	std::vector<Ray> rays;
+	unsigned key(const Ray& ray);
+public:
+	RayQueue(const AABB& bounds);
+	void push(const Ray& ray);
+	bool empty();
+	void trace(Accelerator *accel, std::vector<Ray>& out_rays, std::vector<Hit>& out_hits);
+};
+
+#endif
@@ -0,0 +1,44 @@
+#include "sampler.hpp"
+
+#include <cmath>
+
+/**
+ * The finalizer of SplitMix64, a bijection that spreads every input bit
+ * over the whole output
+ * @param  x The value to mix
+ * @return   The mixed value
+ */
+static inline unsigned long long mix(unsigned long long x) {
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/**
+ * @constructor
+ * @param seed   The seed given on the command line
+ * @param stream The stream, like the index of a pixel
+ */
+Sampler::Sampler(unsigned long long seed, unsigned long long stream) {
+	key = mix(mix(seed) + stream);
+	counter = 0;
+}
+
+/**
+ * The next uniform number of the stream. The top 24 bits of the hash fill
+ * the mantissa, so 1.0 is never returned.
+ * @return A number in [0, 1)
+ */
+float Sampler::uniform() {
+	unsigned long long bits = mix(key + 0x9e3779b97f4a7c15ULL*++counter);
+	return (bits >> 40) * (1.0f/16777216.0f);
+}
+
+/**
+ * The next normal number of the stream, with the Box-Muller transform
+ * @return A number from the normal distribution of mean 0 and deviation 1
+ */
+float Sampler::normal() {
+	float u1 = 1.0f - uniform(), u2 = uniform(); // u1 in (0, 1] for the log
+	return std::sqrt(-2.0f*std::log(u1)) * std::cos(2.0f*(float) M_PI*u2);
+}
@@ -0,0 +1,21 @@
+#ifndef _SAMPLER_HPP
+#define _SAMPLER_HPP
+
+/**
+ * Sampler is a counter-based random number stream. The n-th number of a
+ * stream is a hash of the seed, the stream and n, so a stream only depends
+ * on its key and not on which thread draws from it or what other streams
+ * drew before. Every pixel gets its own stream, which keeps renders
+ * bit-identical for any number of threads.
+ * 	uniform:	the next number in [0, 1)
+ * 	normal:	the next number from the standard normal distribution
+ */
+class Sampler {
+	unsigned long long key, counter;
+public:
+	Sampler(unsigned long long seed=0, unsigned long long stream=0);
+	float uniform();
+	float normal();
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * The tasks waiting on one thread. The owner pops from the front and
+ * thieves from the back.
+ */
+struct WorkQueue {
+	std::mutex lock;
+	std::deque<int> tasks;
+};
+
+/**
+ * Takes a task from the front of a queue
+ * @param  q The queue
+ * @return   The task, or -1 if the queue is empty
+ */
+static int pop_front(WorkQueue& q) {
+	std::lock_guard<std::mutex> guard(q.lock);
+	if (q.tasks.empty())
+		return -1;
+	int i = q.tasks.front();
+	q.tasks.pop_front();
+	return i;
+}
+
+/**
+ * Takes a task from the back of a queue
+ * @param  q The queue
+ * @return   The task, or -1 if the queue is empty
+ */
+static int pop_back(WorkQueue& q) {
+	std::lock_guard<std::mutex> guard(q.lock);
+	if (q.tasks.empty())
+		return -1;
+	int i = q.tasks.back();
+	q.tasks.pop_back();
+	return i;
+}
+
+/**
+ * The threads of parallel_for, which wait for the next call between
+ * calls instead of being started and joined for every one. The pool
+ * grows to the most threads asked for and the threads are joined at
+ * exit. One call runs at a time; the calling thread takes part as
+ * thread 0.
+ */
+class ThreadPool {
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable wake, done;
+	const std::function<void(int)> *job; // the work of the current call
+	unsigned long long generation; // counts the calls, so a thread sees each one once
+	int wanted; // the pool threads taking part in the current call
+	int running; // and the ones not done with it
+	bool closing;
+	void work(int t, unsigned long long seen);
+public:
+	std::mutex busy; // held for a whole call
+	ThreadPool() : job(NULL), generation(0), wanted(0), running(0), closing(false) {}
+	~ThreadPool();
+	void run(int count, const std::function<void(int)>& f);
+};
+
+/**
+ * A thread of the pool: runs its part of every call it takes part in
+ * @param t    The number of the thread, from 1
+ * @param seen The last call before the thread was started
+ */
+void ThreadPool::work(int t, unsigned long long seen) {
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		wake.wait(guard, [&]() { return closing || generation != seen; });
+		if (closing)
+			return;
+		seen = generation;
+		if (t > wanted)
+			continue;
+		guard.unlock();
+		(*job)(t);
+		guard.lock();
+		if (--running == 0)
+			done.notify_one();
+	}
+}
+
+/** Stops the threads */
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closing = true;
+	}
+	wake.notify_all();
+	for (std::thread& th : threads)
+		th.join();
+}
+
+/**
+ * Runs f(t) for every t in [0, count) and waits for all of them, f(0) on
+ * the calling thread and the others on the pool
+ * @param count The number of threads
+ * @param f     The work of a thread
+ */
+void ThreadPool::run(int count, const std::function<void(int)>& f) {
+	std::unique_lock<std::mutex> guard(lock);
+	while ((int) threads.size() < count-1)
+		threads.push_back(std::thread(&ThreadPool::work, this, (int) threads.size()+1, generation));
+	job = &f;
+	wanted = running = count-1;
+	generation++;
+	guard.unlock();
+	wake.notify_all();
+
+	f(0);
+
+	guard.lock();
+	done.wait(guard, [&]() { return running == 0; });
+	job = NULL;
+}
+
+static ThreadPool pool;
+
+/**
+ * The number of threads to use
+ * @param  threads The number asked for, 0 or less for all cores
+ * @return         At least 1
+ */
+int thread_count(int threads) {
+	if (threads > 0)
+		return threads;
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * Runs the tasks with work stealing, see scheduler.hpp. No task is added
+ * once the threads run, so a thread that finds every queue empty is done.
+ * The threads come from the pool; a call made while another one runs,
+ * which the renderer does not do, starts threads of its own.
+ * @param count   The number of tasks
+ * @param threads The number of threads
+ * @param task    Called with the task and the thread running it
+ */
+void parallel_for(int count, int threads, const std::function<void(int, int)>& task) {
+	threads = std::max(1, std::min(threads, count));
+	if (threads == 1) {
+		for (int i=0; i<count; i++)
+			task(i, 0);
+		return;
+	}
+
+	std::vector<WorkQueue> queues(threads);
+	for (int t=0; t!=threads; t++)
+		for (int i=(long long) count*t/threads; i!=(long long) count*(t+1)/threads; i++)
+			queues[t].tasks.push_back(i);
+
+	auto worker = [&](int t) {
+		for (;;) {
+			int i = pop_front(queues[t]);
+			for (int k=1; k!=threads && i<0; k++)
+				i = pop_back(queues[(t+k)%threads]);
+			if (i < 0)
+				return;
+			task(i, t);
+		}
+	};
+
+	std::unique_lock<std::mutex> busy(pool.busy, std::try_to_lock);
+	if (busy.owns_lock()) {
+		pool.run(threads, worker);
+		return;
+	}
+	std::vector<std::thread> own;
+	for (int t=1; t!=threads; t++)
+		own.push_back(std::thread(worker, t));
+	worker(0);
+	for (std::thread& th : own)
+		th.join();
+}
@@ -0,0 +1,23 @@
+#ifndef _SCHEDULER_HPP
+#define _SCHEDULER_HPP
+
+#include <functional>
+
+/**
+ * The number of threads to use for a --threads value: the value itself,
+ * or the number of cores if it is 0 or less.
+ */
+int thread_count(int threads);
+
+/**
+ * Runs task(i, thread) for every i in [0, count) on the given number of
+ * threads, with work stealing. Every thread starts with its own block of
+ * consecutive tasks, which keeps neighbouring tiles on the same core, and
+ * takes them from the front. A thread that runs out steals from the back
+ * of the other threads' blocks, so uneven tasks still keep every core busy
+ * until the end. thread is in [0, threads) and the calling thread is 0.
+ * The threads are kept in a pool between calls.
+ */
+void parallel_for(int count, int threads, const std::function<void(int, int)>& task);
+
+#endif
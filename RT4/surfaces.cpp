@@ -4,25 +4,30 @@
 #include <cmath>
 #include <cstdio>
 #include <iostream>
+#include <utility>
 
 /**
- * Given A, B, C, it solves the quadratic equation and returns the 
- * smallest solution, or -1 if no solution exists. 
- * @param  A t^2 term
- * @param  B t term
- * @param  C constant
- * @return the smallest solution or -1 if not solution was found
+ * Intersects a ray with a sphere at the origin in the stable form of the
+ * quadratic: the discriminant comes from the distance of the center to the
+ * ray, which does not cancel for small spheres far away, and the near root
+ * from c/q, which does not cancel either.
+ * @param  org       The origin of the ray, from the center of the sphere
+ * @param  dir       The direction of the ray, of any length
+ * @param  r2        The squared radius
+ * @param  out_t_max The larger root
+ * @return           The smaller root or -1 if the ray misses
  */
-float solve_quadratic(float A, float B, float C, float &out_t_max) {
-	float disc = pow(B, 2.0) - 4.0*A*C;
+float solve_sphere(const Vec3& org, const Vec3& dir, float r2, float &out_t_max) {
+	float a = dir.dot(dir), b = -org.dot(dir), c = org.dot(org) - r2;
+	Vec3 l = org + (b/a)*dir;
+	float disc = a*(r2 - l.dot(l));
 	if (disc < 0.0)
-		return -NAN;
+		return out_t_max = -1.0;
 
-	float t1, t2;
-	t1 = (-B + sqrt(disc))/(2.0*A);
-	t2 = (-B - sqrt(disc))/(2.0*A);
+	float q = b + copysignf(sqrtf(disc), b);
+	float t1 = c/q, t2 = q/a;
 
-	out_t_max = t1>t2? t1: t2; 
+	out_t_max = t1>t2? t1: t2;
 	return t1<t2? t1: t2;
 }
 
@@ -35,10 +40,15 @@ std::vector<Vec3> Surface::vertex_array;
 std::vector<float> Surface::u_array;
 std::vector<float> Surface::v_array;
 std::vector<Vec3> Surface::n_array;
+std::vector<std::vector<Vec3> > Surface::frames;
+
+/** Virtual destructor so the surfaces can be deleted through the base */
+Surface::~Surface() {}
 
 /** Virtual function for hit. Not supposed to be used.  */
-float Surface::hit(Ray r, float& out_t_max) {
-	return out_t_max=-1.0;
+float Surface::hit(Ray r, Hit& out_hit) {
+	out_hit.surface = out_hit.prim = this;
+	return out_hit.t = out_hit.t_max = -1.0;
 }
 
 /** Virtual function for print. Not supposed to be used. */
@@ -47,17 +57,25 @@ void Surface::print() {
 }
 
 /** Virtual function for get_normal. Don't use.  */
-Vec3 Surface::get_normal(Vec3 intersect) {
+Vec3 Surface::get_normal(const Hit& hit, Vec3 intersect) {
 	return intersect;
 }
 
+/** Virtual function for get_bounds. Don't use.  */
+AABB Surface::get_bounds() {
+	return AABB();
+}
+
+/** Virtual function for update_vertices. Surfaces without vertices stay put. */
+void Surface::update_vertices() {}
+
 /** Virtual function for get_x. Don't use.  */
-float Surface::get_u(Vec3& p) {
+float Surface::get_u(const Hit& hit, Vec3& p) {
 	return -1.0;
 }
 
 /** Virtual function for get_y. Don't use.  */
-float Surface::get_v(Vec3& p) {
+float Surface::get_v(const Hit& hit, Vec3& p) {
 	return -1.0;
 }
 
@@ -96,34 +114,42 @@ void Sphere::print() {
 /**
  * Checks if the given ray intersects the sphere.
  * Otherwise -1.0 is returned.
- * @param  r The Ray
+ * @param  r       The Ray
+ * @param  out_hit The record of the hit
  * @return -1.0 if no intersection. Otherwise the smallest value of the param t
  *              in r(t) such that r(t) lies lies on the sphere. 
  */
-float Sphere::hit(Ray r, float& out_t_max) {
-	Vec3 dif = r.org-center;
-
-	float A = 1.0;
-	float B = 2.0*r.dir.dot(dif);
-	float C = dif.dot(dif) - pow(this->r, 2.0);
-	return solve_quadratic(A, B, C, out_t_max);
+float Sphere::hit(Ray r, Hit& out_hit) {
+	out_hit.surface = out_hit.prim = this;
+	return out_hit.t = solve_sphere(r.org - center, r.dir, this->r*this->r, out_hit.t_max);
 }
 
 /**
  * Returns the surface normal at the point of intersection
+ * @param  hit       The record of the hit
  * @param  intersect The point of intersection on the surface
  * @return           The unit normal vector N 
  */
-Vec3 Sphere::get_normal(Vec3 intersect) {
+Vec3 Sphere::get_normal(const Hit& hit, Vec3 intersect) {
 	return (intersect - center).normalize();
 }
 
+/**
+ * Returns the box enclosing the sphere
+ * @return The bounding box
+ */
+AABB Sphere::get_bounds() {
+	Vec3 ext(r, r, r);
+	return AABB(center - ext, center + ext);
+}
+
 /**
  * Get the x texture coordinate at point p
- * @param  p The point on sphere
- * @return   The x texture coordinate
+ * @param  hit The record of the hit
+ * @param  p   The point on sphere
+ * @return     The x texture coordinate
  */
-float Sphere::get_u(Vec3& p) {
+float Sphere::get_u(const Hit& hit, Vec3& p) {
 	float theta = std::atan2(p.y-center.y, p.x-center.x);
 	assert((!std::isnan(theta)));
 	if (theta < 0)
@@ -134,10 +160,11 @@ float Sphere::get_u(Vec3& p) {
 
 /**
  * Get the y texture coordinate at point p
- * @param  p The point on sphere
- * @return   The y texture coordinate
+ * @param  hit The record of the hit
+ * @param  p   The point on sphere
+ * @return     The y texture coordinate
  */
-float Sphere::get_v(Vec3& p) {
+float Sphere::get_v(const Hit& hit, Vec3& p) {
 	float ratio = (p.z-center.z)/r;
 	float phi = std::acos(ratio>1.0? 1.0: ratio);
 	assert((!std::isnan(phi)));
@@ -164,8 +191,20 @@ Ellipsoid::Ellipsoid() { type=2; }
  * @param mtl_color	the color of the material
  */
 Ellipsoid::Ellipsoid(float x, float y, float z, float a, float b, float c, MtlColor mtl_color) {
-	center = Vec3(x, y, z);
-	this->a = a; this->b = b; this->c = c;
+	to_world = Transform::translate(Vec3(x, y, z))*Transform::scale(Vec3(a, b, c));
+	to_object = to_world.inverse();
+	this->mtl_color = mtl_color;
+	type = 2;
+}
+
+/**
+ * @constructor
+ * Constructor for an Ellipsoid in any position.
+ * @param to_world	moves the unit sphere at the origin onto the ellipsoid
+ * @param mtl_color	the color of the material
+ */
+Ellipsoid::Ellipsoid(Transform to_world, MtlColor mtl_color) : to_world(to_world) {
+	to_object = to_world.inverse();
 	this->mtl_color = mtl_color;
 	type = 2;
 }
@@ -174,61 +213,73 @@ Ellipsoid::Ellipsoid(float x, float y, float z, float a, float b, float c, MtlCo
  * Prints the information of the Ellipsoid
  */
 void Ellipsoid::print() {
-	printf("Ellipsoid:= Center: (%.3f, %.3f, %.3f) Axis: (%.3f, %.3f, %.3f) ", center.x, center.y, center.z, a, b, c);
+	printf("Ellipsoid:= ");
+	to_world.print();
 	mtl_color.print();
 }
 
 /**
- * Checks if the Ray r intersects the Ellipsoid.
- * @param  r The ray
- * @return   -1.0 is no intersection. Otherwise the smallest value of t in
- *            r(t) such that r(t) lies on the ellipsoid.
+ * Checks if the Ray r intersects the Ellipsoid. The ray is moved into the
+ * space of the unit sphere without normalizing its direction, so t is the
+ * same in both spaces.
+ * @param  r       The ray
+ * @param  out_hit The record of the hit
+ * @return         -1.0 is no intersection. Otherwise the smallest value of t in
+ *                 r(t) such that r(t) lies on the ellipsoid.
  */
-float Ellipsoid::hit(Ray r, float& out_t_max) {
-	float A = pow(r.dir.x, 2.0)/pow(a, 2.0) + 
-						pow(r.dir.y, 2.0)/pow(b, 2.0) +
-						pow(r.dir.z, 2.0)/pow(c, 2.0);
-
-	float B = ((r.org.x - center.x)*r.dir.x)/pow(a, 2.0) +
-						((r.org.y - center.y)*r.dir.y)/pow(b, 2.0) +
-						((r.org.z - center.z)*r.dir.z)/pow(c, 2.0);
-	B *= 2.0;
-	float C = 	pow(r.org.x-center.x, 2.0)/pow(a, 2.0) +
-				pow(r.org.y-center.y, 2.0)/pow(b, 2.0) +
-				pow(r.org.z-center.z, 2.0)/pow(c, 2.0) -
-				1.0;
-
-	return solve_quadratic(A, B, C, out_t_max);
+float Ellipsoid::hit(Ray r, Hit& out_hit) {
+	out_hit.surface = out_hit.prim = this;
+	return out_hit.t = solve_sphere(to_object.point(r.org), to_object.vector(r.dir), 1.0, out_hit.t_max);
 }
 
 /**
- * Returns the surface normal at the point of intersection
+ * Returns the surface normal at the point of intersection, the normal of
+ * the unit sphere moved to the world with the inverse transpose
+ * @param  hit       The record of the hit
  * @param  intersect The point of intersection on the surface
  * @return           The unit normal vector N 
  */
-Vec3 Ellipsoid::get_normal(Vec3 intersect) {
-	return (intersect - center).normalize();
+Vec3 Ellipsoid::get_normal(const Hit& hit, Vec3 intersect) {
+	return to_object.transpose_vector(to_object.point(intersect)).normalize();
 }
 
 /**
- * Get the x texture coordinate at point p
- * @param  p The point on sphere
- * @return   The x texture coordinate
+ * Returns the box enclosing the ellipsoid. Along each axis of the world it
+ * reaches as far from the center as the length of that row of to_world.
+ * @return The bounding box
  */
-float Ellipsoid::get_u(Vec3& p) {
-	float theta = std::atan2(a*(p.y-center.y), b*(p.x-center.x));
-	if (theta < 2*M_PI)
+AABB Ellipsoid::get_bounds() {
+	const float (&m)[3][3] = to_world.m;
+	Vec3 ext(Vec3(m[0][0], m[0][1], m[0][2]).norm(), Vec3(m[1][0], m[1][1], m[1][2]).norm(),
+					 Vec3(m[2][0], m[2][1], m[2][2]).norm());
+	return AABB(to_world.d - ext, to_world.d + ext);
+}
+
+/**
+ * Get the x texture coordinate at point p, the longitude of the point on
+ * the unit sphere
+ * @param  hit The record of the hit
+ * @param  p   The point on the ellipsoid
+ * @return     The x texture coordinate
+ */
+float Ellipsoid::get_u(const Hit& hit, Vec3& p) {
+	Vec3 q = to_object.point(p);
+	float theta = std::atan2(q.y, q.x);
+	if (theta < 0)
 		theta += 2*M_PI;
 	return theta/(2*M_PI);
 }
 
 /**
- * Get the y texture coordinate at point p
- * @param  p The point on sphere
- * @return   The y texture coordinate
+ * Get the y texture coordinate at point p, the colatitude of the point on
+ * the unit sphere
+ * @param  hit The record of the hit
+ * @param  p   The point on the ellipsoid
+ * @return     The y texture coordinate
  */
-float Ellipsoid::get_v(Vec3& p) {
-	float phi = std::acos((p.z-center.z)/c);
+float Ellipsoid::get_v(const Hit& hit, Vec3& p) {
+	float z = to_object.point(p).z;
+	float phi = std::acos(z>1.0? 1.0: (z<-1.0? -1.0: z));
 	return phi/M_PI;
 }
 
@@ -249,9 +300,9 @@ Triangle::Triangle() { type=3; }
  * @param third 	The index in the vertex array of the third vertex
  */
 Triangle::Triangle(int c[3], int n[3], int v[3], MtlColor color, int tidx) {
-	p0 = vertex_array[v[0]-1];
-	p1 = vertex_array[v[1]-1];
-	p2 = vertex_array[v[2]-1];
+	for (int i=0; i!=3; i++)
+		vi[i] = v[i]-1;
+	update_vertices();
 	type = 3;
 
 	if (has_texture=(c[0]!=0)) {
@@ -273,72 +324,156 @@ Triangle::Triangle(int c[3], int n[3], int v[3], MtlColor color, int tidx) {
 	}
 
 	mtl_color = color;
+}
 
-	Vec3 e1 = p1-p0, e2 = p2-p0, normal = e1.cross(e2).normalize();
-	A = normal.x, B = normal.y, C = normal.z, D = -(A*p0.x + B*p0.y + C*p0.z);
+/**
+ * Reads the vertices from vertex_array and recalculates the plane of the
+ * triangle. Called by the constructor and for every animation frame.
+ */
+void Triangle::update_vertices() {
+	for (int i=0; i!=3; i++) {
+		const Vec3& v = vertex_array[vi[i]];
+		verts[i][0] = v.x; verts[i][1] = v.y; verts[i][2] = v.z;
+	}
+
+	Vec3 normal = (vertex(1)-vertex(0)).cross(vertex(2)-vertex(0)).normalize();
+	A = normal.x, B = normal.y, C = normal.z;
 }
 
 /**
  * Prints the vertices of the triangle.
  */
 void Triangle::print() {
+	Vec3 p0 = vertex(0), p1 = vertex(1), p2 = vertex(2);
 	printf("Triangle:= p0(%.3f, %.3f, %.3f) p1(%.3f, %.3f, %.3f) p2(%.3f, %.3f, %.3f) t_idx:%i\n", p0.x, p0.y, p0.z, p1.x, p1.y, p1.z, p2.x, p2.y, p2.z, t_idx);
 }
 
 /**
- * Calculate the triangle intersection
- * @param  ray The ray to test for intersection
- * @return     The t value at the point of intersection, or -1 otherwise.
+ * @constructor
+ * Picks the axes and the shear of the ray for the watertight test. kx and
+ * ky are swapped for a negative direction so the winding of the triangle
+ * does not flip.
+ * @param ray The ray
  */
-float Triangle::hit(Ray ray, float& out_t_max) {
-	#define _IS_IN(x) (x>=0.0 && x<=1.0)
-	#define _TRI_EPS (.0001)
+ShearedRay::ShearedRay(const Ray& ray) {
+	org[0] = ray.org.x; org[1] = ray.org.y; org[2] = ray.org.z;
+	float dir[3] = {ray.dir.x, ray.dir.y, ray.dir.z};
+	kz = fabsf(dir[0]) > fabsf(dir[1])? (fabsf(dir[0]) > fabsf(dir[2])? 0: 2): (fabsf(dir[1]) > fabsf(dir[2])? 1: 2);
+	kx = (kz+1)%3; ky = (kx+1)%3;
+	if (dir[kz] < 0.0)
+		std::swap(kx, ky);
+	Sx = dir[kx]/dir[kz]; Sy = dir[ky]/dir[kz]; Sz = 1.0f/dir[kz];
+}
 
-	Vec3 coeff(A, B, C);
-	float t = -(coeff.dot(ray.org) + D)/(coeff.dot(ray.dir));
-	if (std::isnan(t)) // ray is parallel to the plane
-		return -1.0;
+/**
+ * Calculate the triangle intersection with the watertight test: the
+ * vertices are moved to the ray origin and sheared so the ray runs along
+ * +z, and the edge functions U, V, W of the 2D triangle are its
+ * barycentric coordinates up to a common scale. A point on an edge gives
+ * an exact zero, which is redone in double precision to decide the side
+ * consistently for both triangles of the edge. Both windings hit.
+ * @param  ray     The ray, sheared
+ * @param  t_min   The hit must be beyond this
+ * @param  t_max   and before this
+ * @param  out_hit The record of the hit, filled in only on a hit
+ * @return         true on a hit
+ */
+bool Triangle::intersect(const ShearedRay& ray, float t_min, float t_max, Hit& out_hit) {
+	const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+	float a[3], b[3], c[3];
+	for (int i=0; i!=3; i++) {
+		a[i] = verts[0][i] - ray.org[i];
+		b[i] = verts[1][i] - ray.org[i];
+		c[i] = verts[2][i] - ray.org[i];
+	}
+	float ax = a[kx] - ray.Sx*a[kz], ay = a[ky] - ray.Sy*a[kz];
+	float bx = b[kx] - ray.Sx*b[kz], by = b[ky] - ray.Sy*b[kz];
+	float cx = c[kx] - ray.Sx*c[kz], cy = c[ky] - ray.Sy*c[kz];
+
+	float U = cx*by - cy*bx, V = ax*cy - ay*cx, W = bx*ay - by*ax;
+	if (U == 0.0f || V == 0.0f || W == 0.0f) {
+		U = (float) ((double) cx*by - (double) cy*bx);
+		V = (float) ((double) ax*cy - (double) ay*cx);
+		W = (float) ((double) bx*ay - (double) by*ax);
+	}
+	if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+		return false;
+	float det = U + V + W;
+	if (det == 0.0f) // the ray is in the plane, or the triangle is degenerate
+		return false;
+
+	float T = ray.Sz*(U*a[kz] + V*b[kz] + W*c[kz]);
+	float inv_det = 1.0f/det, t = T*inv_det;
+	if (!(t > t_min && t < t_max))
+		return false;
+	out_hit.surface = out_hit.prim = this;
+	out_hit.alpha = U*inv_det, out_hit.beta = V*inv_det, out_hit.gamma = W*inv_det;
+	out_hit.t = out_hit.t_max = t;
+	return true;
+}
 
-	Vec3 p = ray(t), e1 = p1-p0, e2 = p2-p0, e3 = p-p1, e4 = p-p2;
-	float area = .5*e1.cross(e2).norm(), a = .5*e3.cross(e4).norm(), b = .5*e4.cross(e2).norm(), c = .5*e1.cross(e3).norm();
-	alpha = a/area, beta = b/area, gamma = c/area;
-	return out_t_max=(_IS_IN(alpha) && _IS_IN(beta) && _IS_IN(gamma) && alpha+beta+gamma-1.0<=_TRI_EPS)? t: -1.0;
+/**
+ * Calculate the triangle intersection. The barycentric coordinates go to
+ * the hit record.
+ * @param  ray     The ray to test for intersection
+ * @param  out_hit The record of the hit
+ * @return         The t value at the point of intersection, or -1 otherwise.
+ */
+float Triangle::hit(Ray ray, Hit& out_hit) {
+	if (intersect(ShearedRay(ray), 0.0, INFINITY, out_hit))
+		return out_hit.t;
+	out_hit.surface = out_hit.prim = this;
+	return out_hit.t = out_hit.t_max = -1.0;
 }
 
 /**
  * Return the normal of the triangle at the point of intersection
+ * @param  hit       The record of the hit, for the barycentric coordinates
  * @param  intersect The point of intersection
  * @return           [description]
  */
-Vec3 Triangle::get_normal(Vec3 intersect) {
-	return has_normal	? (alpha*n0 + beta*n1 + gamma*n2).normalize()
+Vec3 Triangle::get_normal(const Hit& hit, Vec3 intersect) {
+	return has_normal	? (hit.alpha*n0 + hit.beta*n1 + hit.gamma*n2).normalize()
 										: Vec3(A, B, C);
 }
 
 /**
- * Get the u texture coordinate at point p. Assumes is called after hit is called.
- * @param  p The point on sphere
- * @return   The u texture coordinate
+ * Returns the box enclosing the three vertices. The watertight test only
+ * hits inside the edges, so the box needs no padding.
+ * @return The bounding box
+ */
+AABB Triangle::get_bounds() {
+	AABB box;
+	box.grow(vertex(0)); box.grow(vertex(1)); box.grow(vertex(2));
+	return box;
+}
+
+/**
+ * Get the u texture coordinate at point p
+ * @param  hit The record of the hit, for the barycentric coordinates
+ * @param  p   The point on sphere
+ * @return     The u texture coordinate
  */
-float Triangle::get_u(Vec3& p) {
+float Triangle::get_u(const Hit& hit, Vec3& p) {
 	if (!has_texture) {
 		std::cout << "attempting to access texture coordinate of not textured triangle" << std::endl;
 		this->print();
 		exit(1);
 	}
-	return alpha*u0 + beta*u1 + gamma*u2;
+	return hit.alpha*u0 + hit.beta*u1 + hit.gamma*u2;
 }
 
 /**
- * Get the u texture coordinate at point p. Assumes is called after hit is called.
- * @param  p The point on sphere
- * @return   The u texture coordinate
+ * Get the v texture coordinate at point p
+ * @param  hit The record of the hit, for the barycentric coordinates
+ * @param  p   The point on sphere
+ * @return     The v texture coordinate
  */
-float Triangle::get_v(Vec3& p) {
+float Triangle::get_v(const Hit& hit, Vec3& p) {
 	if (!has_texture) {
 		std::cout << "attempting to access texture coordinate of not textured triangle" << std::endl;
 		this->print();
 		exit(1);
 	}
-	return alpha*v0 + beta*v1 + gamma*v2;
+	return hit.alpha*v0 + hit.beta*v1 + hit.gamma*v2;
 }
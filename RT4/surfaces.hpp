@@ -1,17 +1,45 @@
 #ifndef _SURFACES_HPP
 #define _SURFACES_HPP
 
+#include <cmath>
+#include <cstddef>
 #include <vector>
 
 #include "geometry.hpp"
 #include "image.hpp"
 
+class Surface;
+
+/**
+ * Hit is the record of a ray hitting a surface. hit fills it in and the
+ * shading calls read it, so the surfaces keep no state of their own and
+ * many threads can intersect the same surface at once.
+ * t, t_max:	the smallest and largest t of the hit, as returned by hit
+ * alpha, beta, gamma:	the barycentric coordinates of a triangle hit
+ * surface:	the surface of the scene that was hit
+ * prim:	the primitive that was hit: the triangle of an instance, or the
+ * 	surface itself. Its mtl_color and t_idx are the ones to shade with
+ * index:	the particle that was hit, set by a SphereCloud only
+ */
+struct Hit {
+	float t, t_max;
+	float alpha, beta, gamma;
+	Surface *surface;
+	Surface *prim;
+	int index;
+	Hit() : t(INFINITY), t_max(INFINITY), alpha(0.0), beta(0.0), gamma(0.0), surface(NULL), prim(NULL), index(-1) {}
+};
+
 /**
  * Surface is a base class which is inherited by all other surface classes.
  * center is the center of the surface
  * mtl_color is the color of the surface.
- * hit finds the intersection
+ * hit finds the intersection and fills in a Hit
+ * get_normal, get_u and get_v shade a point of a Hit
+ * get_bounds returns the axis-aligned box enclosing the surface
+ * update_vertices moves the surface to the positions in vertex_array
  * print prints the surface 
+ * frames holds the vertex positions of the animation frames, if any
  */
 
 class Surface {
@@ -20,16 +48,22 @@ public:
 	static std::vector<float> u_array;
 	static std::vector<float> v_array;
 	static std::vector<Vec3> n_array;
+	static std::vector<std::vector<Vec3> > frames;
 	int t_idx;
 	MtlColor mtl_color;
 	int type;
-	virtual float hit(Ray r, float& out_t_max);
-	virtual Vec3 get_normal(Vec3 intersect);
+	virtual ~Surface();
+	virtual float hit(Ray r, Hit& out_hit);
+	virtual Vec3 get_normal(const Hit& hit, Vec3 intersect);
+	virtual AABB get_bounds();
+	virtual void update_vertices();
 	virtual void print();
-	virtual float get_u(Vec3& p);
-	virtual float get_v(Vec3& p);
+	virtual float get_u(const Hit& hit, Vec3& p);
+	virtual float get_v(const Hit& hit, Vec3& p);
 };
 
+float solve_sphere(const Vec3& org, const Vec3& dir, float r2, float &out_t_max);
+
 /**
  * Sphere is derrived from a surface with radius r.
  */
@@ -40,46 +74,78 @@ public:
 	Sphere();
 	Sphere(float x, float y, float z, float r, MtlColor mtl_color);
 	void print();
-	float hit(Ray r, float& out_t_max);
-	Vec3 get_normal(Vec3 intersect);
-	float get_u(Vec3& p);
-	float get_v(Vec3& p);
+	float hit(Ray r, Hit& out_hit);
+	Vec3 get_normal(const Hit& hit, Vec3 intersect);
+	AABB get_bounds();
+	float get_u(const Hit& hit, Vec3& p);
+	float get_v(const Hit& hit, Vec3& p);
 };
 
 /**
- * Ellipsoid is derrived from a surface with axis (a, b, c).
+ * Ellipsoid is derrived from a surface. It is the unit sphere moved into
+ * the world by to_world: scaled by its axes, rotated and translated to its
+ * center. hit moves the ray into the space of the sphere with to_object
+ * and intersects the unit sphere there, and the normal and the texture
+ * coordinates come from the point in that space, so the ellipsoid may be
+ * turned any way.
+ * 	object_transform:	to_object, which is all hit needs
  */
 class Ellipsoid : public Surface {
+	Transform to_world, to_object;
 public:
-	Vec3 center;
-	float a, b, c;
 	Ellipsoid();
 	Ellipsoid(float x, float y, float z, float a, float b, float c, MtlColor mtl_color);
+	Ellipsoid(Transform to_world, MtlColor mtl_color);
 	void print();
-	float hit(Ray r, float& out_t_max);
-	Vec3 get_normal(Vec3 intersect);
-	float get_u(Vec3& p);
-	float get_v(Vec3& p);
+	float hit(Ray r, Hit& out_hit);
+	Vec3 get_normal(const Hit& hit, Vec3 intersect);
+	AABB get_bounds();
+	float get_u(const Hit& hit, Vec3& p);
+	float get_v(const Hit& hit, Vec3& p);
+	const Transform& object_transform() const { return to_object; }
+};
+
+/**
+ * The part of the watertight triangle test that depends only on the ray
+ * (Woop, Benthin and Wald, 2013): the axis kz where the direction is
+ * largest, the two others kx and ky, and the shear that maps the
+ * direction onto +z. Built once per ray and reused for every triangle.
+ */
+struct ShearedRay {
+	float org[3];
+	int kx, ky, kz;
+	float Sx, Sy, Sz;
+	ShearedRay(const Ray& ray);
 };
 
 /**
  * Triangle is derived from a surface. Its vertices are v1, v2, v3.
+ * vi holds their indices in vertex_array so the triangle can follow the
+ * vertices when they move. The vertices are kept as arrays so the
+ * intersection can pick their coordinates by axis.
+ * 	intersect:	the watertight test over (t_min, t_max). Rays through an
+ * 		edge or vertex shared by two triangles hit at least one of them.
+ * 	vertex:	the position of vertex i
  */
 class Triangle : public Surface {
-	Vec3 p0, p1, p2;
+	int vi[3];
+	float verts[3][3];
 	float u0, u1, u2, v0, v1, v2;
 	Vec3 n0, n1, n2;
 	bool has_texture, has_normal;
 public:
-	float A, B, C, D; // coefficients of equation of plane
-	float alpha, beta, gamma;
+	float A, B, C; // unit normal of the plane
 	Triangle();
 	Triangle(int c[3], int n[3], int v[3], MtlColor mtlcolor, int t_idx=-1);
 	void print();
-	float hit(Ray r, float& out_t_max);
-	Vec3 get_normal(Vec3 intersect);
-	float get_u(Vec3& p);
-	float get_v(Vec3& p);
+	float hit(Ray r, Hit& out_hit);
+	bool intersect(const ShearedRay& ray, float t_min, float t_max, Hit& out_hit);
+	Vec3 get_normal(const Hit& hit, Vec3 intersect);
+	AABB get_bounds();
+	void update_vertices();
+	float get_u(const Hit& hit, Vec3& p);
+	float get_v(const Hit& hit, Vec3& p);
+	Vec3 vertex(int i) const { return Vec3(verts[i][0], verts[i][1], verts[i][2]); }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,223 @@
+#include "triblock.hpp"
+
+#include <cmath>
+#include <cstring>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRIBLOCK_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * Copies the triangles of a leaf into a block. Unused lanes are zero.
+ * @param block The block
+ * @param leaf  The triangles of the leaf
+ * @param count Their number, at most TRI_BLOCK
+ */
+void fill_block(TriBlock& block, Surface *const *leaf, int count) {
+	memset(&block, 0, sizeof(block));
+	for (int i=0; i!=count; i++) {
+		Triangle *T = (Triangle *) leaf[i];
+		for (int k=0; k!=3; k++) {
+			Vec3 p = T->vertex(k);
+			block.v[k][0][i] = p.x;
+			block.v[k][1][i] = p.y;
+			block.v[k][2][i] = p.z;
+		}
+	}
+	block.count = count;
+}
+
+/**
+ * The watertight test of one lane, the same steps as Triangle::intersect
+ * over (0, INFINITY). The vector kernels come here for the lanes that hit
+ * an edge exactly and need the double precision retry.
+ * @param block    The block
+ * @param ray      The ray, sheared
+ * @param lane     The lane
+ * @param out_hits The hits, only lane is written
+ */
+static void intersect_lane(const TriBlock& block, const ShearedRay& ray, int lane, BlockHits& out_hits) {
+	const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+	float a[3], b[3], c[3];
+	for (int i=0; i!=3; i++) {
+		a[i] = block.v[0][i][lane] - ray.org[i];
+		b[i] = block.v[1][i][lane] - ray.org[i];
+		c[i] = block.v[2][i][lane] - ray.org[i];
+	}
+	float ax = a[kx] - ray.Sx*a[kz], ay = a[ky] - ray.Sy*a[kz];
+	float bx = b[kx] - ray.Sx*b[kz], by = b[ky] - ray.Sy*b[kz];
+	float cx = c[kx] - ray.Sx*c[kz], cy = c[ky] - ray.Sy*c[kz];
+
+	out_hits.t[lane] = -1.0f;
+	float U = cx*by - cy*bx, V = ax*cy - ay*cx, W = bx*ay - by*ax;
+	if (U == 0.0f || V == 0.0f || W == 0.0f) {
+		U = (float) ((double) cx*by - (double) cy*bx);
+		V = (float) ((double) ax*cy - (double) ay*cx);
+		W = (float) ((double) bx*ay - (double) by*ax);
+	}
+	if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+		return;
+	float det = U + V + W;
+	if (det == 0.0f)
+		return;
+
+	float T = ray.Sz*(U*a[kz] + V*b[kz] + W*c[kz]);
+	float inv_det = 1.0f/det, t = T*inv_det;
+	if (!(t > 0.0f && t < INFINITY))
+		return;
+	out_hits.t[lane] = t;
+	out_hits.alpha[lane] = U*inv_det, out_hits.beta[lane] = V*inv_det, out_hits.gamma[lane] = W*inv_det;
+}
+
+/**
+ * The kernel for CPUs without vector units: one lane at a time
+ * @param block    The block
+ * @param ray      The ray, sheared
+ * @param out_hits The hits of the lanes in use
+ */
+static void intersect_scalar(const TriBlock& block, const ShearedRay& ray, BlockHits& out_hits) {
+	for (int lane=0; lane!=block.count; lane++)
+		intersect_lane(block, ray, lane, out_hits);
+}
+
+#ifdef TRIBLOCK_X86
+/**
+ * The SSE kernel: the lanes in two groups of four. Every step is the
+ * scalar one, without fused multiply-adds, so the results are identical.
+ * @param block    The block
+ * @param ray      The ray, sheared
+ * @param out_hits The hits of the lanes in use
+ */
+__attribute__((target("sse2")))
+static void intersect_sse(const TriBlock& block, const ShearedRay& ray, BlockHits& out_hits) {
+	const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+	const __m128 zero = _mm_setzero_ps(), inf = _mm_set1_ps(INFINITY), one = _mm_set1_ps(1.0f);
+	const __m128 miss = _mm_set1_ps(-1.0f);
+	const __m128 sx = _mm_set1_ps(ray.Sx), sy = _mm_set1_ps(ray.Sy), sz = _mm_set1_ps(ray.Sz);
+	const __m128 ox = _mm_set1_ps(ray.org[kx]), oy = _mm_set1_ps(ray.org[ky]), oz = _mm_set1_ps(ray.org[kz]);
+	int retry = 0;
+	for (int base=0; base<block.count; base+=4) {
+		__m128 x[3], y[3], z[3];
+		for (int k=0; k!=3; k++) {
+			z[k] = _mm_sub_ps(_mm_loadu_ps(block.v[k][kz]+base), oz);
+			x[k] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(block.v[k][kx]+base), ox), _mm_mul_ps(sx, z[k]));
+			y[k] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(block.v[k][ky]+base), oy), _mm_mul_ps(sy, z[k]));
+		}
+		__m128 U = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+		__m128 V = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+		__m128 W = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+		retry |= _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(U, zero), _mm_cmpeq_ps(V, zero)),
+																			 _mm_cmpeq_ps(W, zero))) << base;
+
+		__m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+		__m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+		__m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+		__m128 T = _mm_mul_ps(sz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, z[0]), _mm_mul_ps(V, z[1])), _mm_mul_ps(W, z[2])));
+		__m128 inv_det = _mm_div_ps(one, det), t = _mm_mul_ps(T, inv_det);
+		__m128 ok = _mm_andnot_ps(_mm_and_ps(neg, pos), _mm_cmpneq_ps(det, zero));
+		ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, inf)));
+
+		_mm_storeu_ps(out_hits.t+base, _mm_or_ps(_mm_and_ps(ok, t), _mm_andnot_ps(ok, miss)));
+		_mm_storeu_ps(out_hits.alpha+base, _mm_mul_ps(U, inv_det));
+		_mm_storeu_ps(out_hits.beta+base, _mm_mul_ps(V, inv_det));
+		_mm_storeu_ps(out_hits.gamma+base, _mm_mul_ps(W, inv_det));
+	}
+	retry &= (1 << block.count) - 1;
+	for (int lane=0; retry; lane++, retry >>= 1)
+		if (retry & 1)
+			intersect_lane(block, ray, lane, out_hits);
+}
+
+/**
+ * The AVX kernel: all eight lanes at once, the same steps as the SSE one.
+ * Compiled for AVX whatever the flags of the build and only called when
+ * the CPU has it.
+ * @param block    The block
+ * @param ray      The ray, sheared
+ * @param out_hits The hits of the lanes in use
+ */
+__attribute__((target("avx")))
+static void intersect_avx(const TriBlock& block, const ShearedRay& ray, BlockHits& out_hits) {
+	const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+	const __m256 zero = _mm256_setzero_ps(), inf = _mm256_set1_ps(INFINITY), one = _mm256_set1_ps(1.0f);
+	const __m256 miss = _mm256_set1_ps(-1.0f);
+	const __m256 sx = _mm256_set1_ps(ray.Sx), sy = _mm256_set1_ps(ray.Sy), sz = _mm256_set1_ps(ray.Sz);
+	const __m256 ox = _mm256_set1_ps(ray.org[kx]), oy = _mm256_set1_ps(ray.org[ky]), oz = _mm256_set1_ps(ray.org[kz]);
+	__m256 x[3], y[3], z[3];
+	for (int k=0; k!=3; k++) {
+		z[k] = _mm256_sub_ps(_mm256_loadu_ps(block.v[k][kz]), oz);
+		x[k] = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(block.v[k][kx]), ox), _mm256_mul_ps(sx, z[k]));
+		y[k] = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(block.v[k][ky]), oy), _mm256_mul_ps(sy, z[k]));
+	}
+	__m256 U = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+	__m256 V = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+	__m256 W = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+	int retry = _mm256_movemask_ps(_mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_EQ_OQ),
+															 _mm256_cmp_ps(V, zero, _CMP_EQ_OQ)), _mm256_cmp_ps(W, zero, _CMP_EQ_OQ)));
+
+	__m256 neg = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_LT_OQ), _mm256_cmp_ps(V, zero, _CMP_LT_OQ)),
+														_mm256_cmp_ps(W, zero, _CMP_LT_OQ));
+	__m256 pos = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(U, zero, _CMP_GT_OQ), _mm256_cmp_ps(V, zero, _CMP_GT_OQ)),
+														_mm256_cmp_ps(W, zero, _CMP_GT_OQ));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(U, V), W);
+	__m256 T = _mm256_mul_ps(sz, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(U, z[0]), _mm256_mul_ps(V, z[1])),
+																						 _mm256_mul_ps(W, z[2])));
+	__m256 inv_det = _mm256_div_ps(one, det), t = _mm256_mul_ps(T, inv_det);
+	__m256 ok = _mm256_andnot_ps(_mm256_and_ps(neg, pos), _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+	ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, inf, _CMP_LT_OQ)));
+
+	_mm256_storeu_ps(out_hits.t, _mm256_blendv_ps(miss, t, ok));
+	_mm256_storeu_ps(out_hits.alpha, _mm256_mul_ps(U, inv_det));
+	_mm256_storeu_ps(out_hits.beta, _mm256_mul_ps(V, inv_det));
+	_mm256_storeu_ps(out_hits.gamma, _mm256_mul_ps(W, inv_det));
+
+	retry &= (1 << block.count) - 1;
+	for (int lane=0; retry; lane++, retry >>= 1)
+		if (retry & 1)
+			intersect_lane(block, ray, lane, out_hits);
+}
+#endif
+
+typedef void (*BlockKernel)(const TriBlock&, const ShearedRay&, BlockHits&);
+
+/**
+ * Picks the widest kernel the CPU runs
+ * @param  out_name The name of the kernel
+ * @return          The kernel
+ */
+static BlockKernel pick_kernel(const char*& out_name) {
+#ifdef TRIBLOCK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx")) {
+		out_name = "avx";
+		return intersect_avx;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		out_name = "sse";
+		return intersect_sse;
+	}
+#endif
+	out_name = "scalar";
+	return intersect_scalar;
+}
+
+static const char *kernel_name;
+static const BlockKernel kernel = pick_kernel(kernel_name);
+
+/**
+ * Intersects a ray with every triangle of a block
+ * @param block    The block
+ * @param ray      The ray, sheared
+ * @param out_hits The hits of the lanes in use
+ */
+void intersect_block(const TriBlock& block, const ShearedRay& ray, BlockHits& out_hits) {
+	kernel(block, ray, out_hits);
+}
+
+/**
+ * The name of the kernel picked for this CPU, for the statistics
+ * @return "avx", "sse" or "scalar"
+ */
+const char* block_kernel() {
+	return kernel_name;
+}
@@ -0,0 +1,34 @@
+#ifndef _TRIBLOCK_HPP
+#define _TRIBLOCK_HPP
+
+#include "surfaces.hpp"
+
+#define TRI_BLOCK 8	// triangles in a block, a BVH leaf holds at most this many surfaces
+
+/**
+ * The triangles of a BVH leaf stored as structure-of-arrays, so that one
+ * ray is tested against all of them with vector instructions.
+ * v[k][axis][lane] is coordinate axis of vertex k of the triangle in lane.
+ * count is the number of lanes in use. The triangles come first in a leaf
+ * and lane i holds surface i of the leaf.
+ */
+struct TriBlock {
+	float v[3][3][TRI_BLOCK];
+	int count;
+};
+
+/**
+ * The result of intersecting a ray with a block: for each lane the t of
+ * the hit, -1 if the ray misses like Triangle::hit, and the barycentric
+ * coordinates. The values are exactly those of Triangle::intersect.
+ */
+struct BlockHits {
+	float t[TRI_BLOCK];
+	float alpha[TRI_BLOCK], beta[TRI_BLOCK], gamma[TRI_BLOCK];
+};
+
+void fill_block(TriBlock& block, Surface *const *leaf, int count);
+void intersect_block(const TriBlock& block, const ShearedRay& ray, BlockHits& out_hits);
+const char* block_kernel();
+
+#endif
@@ -8,36 +8,245 @@
 #include <iostream>
 
 #include "allexceptions.hpp"
+#include "cloud.hpp"
 #include "geometry.hpp"
 #include "image.hpp"
+#include "instance.hpp"
 #include "lights.hpp"
 #include "params.hpp"
 
 #define VALID(c) (c>=0.0&&c<=1.0)
 
+/**
+ * Reads the command line. Everything that does not start with "--" is the
+ * input file, of which there must be exactly one.
+ * @param  argc The number of arguments
+ * @param  argv The arguments
+ * @return      The options
+ */
+Options parse_args(int argc, char *argv[]) {
+	Options options;
+	for (int i=1; i<argc; i++) {
+		std::string arg(argv[i]);
+		if (arg == "--accel" && i+1<argc) {
+			std::string accel(argv[++i]);
+			if (accel == "bvh")
+				options.accel = ACCEL_BVH;
+			else if (accel == "grid")
+				options.accel = ACCEL_GRID;
+			else if (accel == "grid2")
+				options.accel = ACCEL_TWO_LEVEL_GRID;
+			else if (accel == "brute")
+				options.accel = ACCEL_BRUTE_FORCE;
+			else
+				throw invalid_option(arg + " " + accel);
+		}
+		else if (arg == "--builder" && i+1<argc) {
+			std::string builder(argv[++i]);
+			if (builder == "sah")
+				options.builder = BVH_SAH;
+			else if (builder == "binned")
+				options.builder = BVH_BINNED;
+			else
+				throw invalid_option(arg + " " + builder);
+		}
+		else if (arg == "--layout" && i+1<argc) {
+			std::string layout(argv[++i]);
+			if (layout == "float")
+				options.layout = BVH_FLOAT;
+			else if (layout == "quantized")
+				options.layout = BVH_QUANTIZED;
+			else
+				throw invalid_option(arg + " " + layout);
+		}
+		else if (arg == "--packet" && i+1<argc) {
+			std::string packet(argv[++i]);
+			if (packet == "0" || packet == "8" || packet == "16")
+				options.packet = std::stoi(packet);
+			else
+				throw invalid_option(arg + " " + packet);
+		}
+		else if (arg == "--threads" && i+1<argc) {
+			std::string threads(argv[++i]);
+			char *end;
+			long n = strtol(threads.c_str(), &end, 10);
+			if (threads.empty() || *end != '\0' || n < 0)
+				throw invalid_option(arg + " " + threads);
+			options.threads = n;
+		}
+		else if (arg == "--seed" && i+1<argc) {
+			std::string seed(argv[++i]);
+			char *end;
+			unsigned long long n = strtoull(seed.c_str(), &end, 10);
+			if (seed.empty() || seed[0] == '-' || *end != '\0')
+				throw invalid_option(arg + " " + seed);
+			options.seed = n;
+		}
+		else if (arg == "--passes" && i+1<argc) {
+			std::string passes(argv[++i]);
+			char *end;
+			long n = strtol(passes.c_str(), &end, 10);
+			if (passes.empty() || *end != '\0' || n < 1)
+				throw invalid_option(arg + " " + passes);
+			options.passes = n;
+		}
+		else if (arg == "--snapshot-every" && i+1<argc) {
+			std::string passes(argv[++i]);
+			char *end;
+			long n = strtol(passes.c_str(), &end, 10);
+			if (passes.empty() || *end != '\0' || n < 0)
+				throw invalid_option(arg + " " + passes);
+			options.snapshot_passes = n;
+		}
+		else if (arg == "--snapshot-seconds" && i+1<argc) {
+			std::string seconds(argv[++i]);
+			char *end;
+			double s = strtod(seconds.c_str(), &end);
+			if (seconds.empty() || *end != '\0' || !(s >= 0.0))
+				throw invalid_option(arg + " " + seconds);
+			options.snapshot_seconds = s;
+		}
+		else if (arg == "--depth" && i+1<argc) {
+			std::string depth(argv[++i]);
+			char *end;
+			long n = strtol(depth.c_str(), &end, 10);
+			if (depth.empty() || *end != '\0' || n < 0)
+				throw invalid_option(arg + " " + depth);
+			options.depth = n;
+		}
+		else if (arg == "--shadow-bundle" && i+1<argc) {
+			std::string bundle(argv[++i]);
+			char *end;
+			long n = strtol(bundle.c_str(), &end, 10);
+			if (bundle.empty() || *end != '\0' || n < 1)
+				throw invalid_option(arg + " " + bundle);
+			options.shadow_bundle = n;
+		}
+		else if (arg == "--time-budget" && i+1<argc) {
+			std::string seconds(argv[++i]);
+			char *end;
+			double s = strtod(seconds.c_str(), &end);
+			if (seconds.empty() || *end != '\0' || !(s > 0.0))
+				throw invalid_option(arg + " " + seconds);
+			options.time_budget = s;
+		}
+		else if (arg == "--checkpoint-seconds" && i+1<argc) {
+			std::string seconds(argv[++i]);
+			char *end;
+			double s = strtod(seconds.c_str(), &end);
+			if (seconds.empty() || *end != '\0' || !(s >= 0.0))
+				throw invalid_option(arg + " " + seconds);
+			options.checkpoint_seconds = s;
+		}
+		else if (arg == "--resume")
+			options.resume = true;
+		else if (arg == "--crop" && i+4<argc) {
+			int crop[4];
+			for (int k=0; k!=4; k++) {
+				std::string value(argv[++i]);
+				char *end;
+				long n = strtol(value.c_str(), &end, 10);
+				if (value.empty() || *end != '\0' || n < 0)
+					throw invalid_option(arg + " " + value);
+				crop[k] = n;
+			}
+			if (crop[2] <= crop[0] || crop[3] <= crop[1])
+				throw invalid_option(arg + ": the rectangle is empty");
+			options.crop = Rect{crop[0], crop[1], crop[2], crop[3]};
+		}
+		else if (arg == "--tile-order" && i+1<argc) {
+			std::string order(argv[++i]);
+			if (order == "scanline")
+				options.tile_order = TILE_SCANLINE;
+			else if (order == "spiral")
+				options.tile_order = TILE_SPIRAL;
+			else if (order == "mask")
+				options.tile_order = TILE_MASK;
+			else
+				throw invalid_option(arg + " " + order);
+		}
+		else if (arg == "--mask" && i+1<argc)
+			options.mask = argv[++i];
+		else if (arg == "--farm" && i+1<argc) {
+			std::string farm(argv[++i]);
+			char *end;
+			long n = strtol(farm.c_str(), &end, 10);
+			if (farm.empty() || *end != '\0' || n < 0)
+				throw invalid_option(arg + " " + farm);
+			options.farm = n;
+		}
+		else if (arg == "--worker" && i+1<argc)
+			options.worker = argv[++i];
+		else if (arg == "--batch" && i+1<argc)
+			options.batch = argv[++i];
+		else if (arg == "--benchmark")
+			options.benchmark = true;
+		else if (arg.compare(0, 2, "--") == 0 || options.filename != "")
+			throw invalid_option(arg);
+		else
+			options.filename = arg;
+	}
+
+	if (options.filename == "" && options.batch == "")
+		throw invalid_option("<input-file>");
+	if (options.batch != "" && (options.filename != "" || options.farm > 0 || options.worker != ""))
+		throw invalid_option("--batch with <input-file>, --farm or --worker");
+	if (options.farm > 0 && (options.passes > 1 || options.time_budget > 0.0 || options.worker != ""))
+		throw invalid_option("--farm with --passes, --time-budget or --worker");
+	if (options.tile_order == TILE_MASK && options.mask == "")
+		throw invalid_option("--tile-order mask without --mask");
+	if (options.resume && (options.farm > 0 || options.time_budget > 0.0))
+		throw invalid_option("--resume with --farm or --time-budget");
+	return options;
+}
+
+/**
+ * Finds the mesh with the given name
+ * @param  meshes The meshes read so far
+ * @param  name   The name of the mesh
+ * @return        The mesh, or NULL if there is none with that name
+ */
+static Mesh* find_mesh(std::vector<Mesh*>& meshes, std::string name) {
+	for (Mesh *mesh : meshes)
+		if (mesh->name == name)
+			return mesh;
+	return NULL;
+}
+
 /**
  * Reads the input from the file given by filename and gets the parameters and
  * surfaces. 
  * @param  filename the name of the input file
  * @param  surfaces output parameter which is a vector of Surface pointers.
  * @param  lights output parameter which is a vector of LightSource pointers.
+ * @param  textures output parameter which is a vector of the textures, in the
+ *                order the scene declares them.
+ * @param  meshes output parameter which is a vector of the meshes defined
+ *                between "mesh <name>" and "endmesh". Their triangles are
+ *                not in surfaces, the "instance" lines are.
+ * The "v" lines after a "frame" line are the vertex positions of the next
+ * animation frame. They are stored in Surface::frames.
+ * The "particle" lines all go into one SphereCloud, a single surface.
+ * An "ellipsoid" line may end with the angles it is rotated by about x, y
+ * and z, in degrees, as for an "instance".
+ * @param  cache    where the textures are read from, and kept for other scenes
  * @return          the parameter object is returned
  */
-Params parse_input(std::string filename, std::vector<Surface*>& surfaces, std::vector<LightSource*>& lights, std::vector<Texture*>& textures) {
+Params parse_input(std::string filename, std::vector<Surface*>& surfaces, std::vector<LightSource*>& lights, std::vector<Texture*>& textures, std::vector<Mesh*>& meshes, TextureCache& cache) {
 	std::ifstream in( filename.c_str() );
 	Params params;
 	params.parallel = false;
 	std::string path = get_path(filename);
-	if (!in.is_open()) {
-		std::cout << "could not open file \'" << filename << "\'\n";
-		exit(1);
-	}
+	if (!in.is_open())
+		throw invalid_file(filename);
 
 	bool gotit[6] = {false};
 
 	std::string line = "";
 	MtlColor mtlcolor;
 	int t_idx=-1;
+	Mesh *mesh = NULL; // the mesh being read, if any
+	SphereCloud *cloud = NULL; // holds the particles, made at the first one
 	while (std::getline(in, line)) {
 		std::stringstream ss(line);
 		std::string keyword = "";
@@ -125,7 +334,7 @@ Params parse_input(std::string filename, std::vector<Surface*>& surfaces, std::v
 			float x, y, z, r; r=NAN;
 			ss >> x >> y >> z >> r;
 
-			if (std::isnan(r) || r<=0.0)
+			if (std::isnan(r) || r<=0.0 || mesh)
 				throw invalid_scene_file();
 
 			Surface *s = new Sphere(x, y, z, r, mtlcolor);
@@ -133,16 +342,37 @@ Params parse_input(std::string filename, std::vector<Surface*>& surfaces, std::v
 			surfaces.push_back(s);
 		}
 		else if (keyword == "ellipsoid") {
-			float x, y, z, rx, ry, rz; rz=NAN;
+			float x, y, z, rx, ry, rz, ax, ay, az; rz=NAN; ax=ay=az=0.0;
 			ss >> x >> y >> z >> rx >> ry >> rz;
+			if (ss >> ax) {
+				az = NAN;
+				ss >> ay >> az;
+			}
 
-			if (std::isnan(rz) || rx<=0.0 || ry<=0.0 || rz<=0.0)
+			if (std::isnan(rz) || std::isnan(az) || rx<=0.0 || ry<=0.0 || rz<=0.0 || mesh)
 				throw invalid_scene_file();
 
-			Surface *e = new Ellipsoid(x, y, z, rx, ry, rz, mtlcolor);
+			/* scale, then rotate about x, y and z, then translate, as for an instance */
+			Transform to_world = Transform::translate(Vec3(x, y, z)) *
+				Transform::rotate(2, az) * Transform::rotate(1, ay) * Transform::rotate(0, ax) *
+				Transform::scale(Vec3(rx, ry, rz));
+			Surface *e = new Ellipsoid(to_world, mtlcolor);
 			e->t_idx = t_idx;
 			surfaces.push_back(e);
 		}
+		else if (keyword == "particle") {
+			float x, y, z, r; r=NAN;
+			ss >> x >> y >> z >> r;
+
+			if (std::isnan(r) || r<=0.0 || mesh)
+				throw invalid_scene_file();
+
+			if (!cloud) {
+				cloud = new SphereCloud();
+				surfaces.push_back(cloud);
+			}
+			cloud->add(x, y, z, r, mtlcolor, t_idx);
+		}
 		else if (keyword == "f") {
 			int n[3]={0}, c[3]={0}, v[3], beg, end;
 			for (int i=0; i!=3; i++) {
@@ -169,14 +399,53 @@ Params parse_input(std::string filename, std::vector<Surface*>& surfaces, std::v
 					throw invalid_scene_file();
 			}
 			Triangle *t = new Triangle(c, n, v, mtlcolor, t_idx);
-			surfaces.push_back(t);
+			if (mesh)
+				mesh->triangles.push_back(t);
+			else
+				surfaces.push_back(t);
+		}
+		else if (keyword == "mesh") {
+			std::string name;
+			ss >> name;
+			if (name.length() == 0 || mesh || find_mesh(meshes, name))
+				throw invalid_scene_file();
+			mesh = new Mesh(name);
+			meshes.push_back(mesh);
+		}
+		else if (keyword == "endmesh") {
+			if (!mesh)
+				throw invalid_scene_file();
+			mesh = NULL;
+		}
+		else if (keyword == "instance") {
+			std::string name;
+			float tx, ty, tz, sx, sy, sz, rx, ry, rz; rz=NAN;
+			ss >> name >> tx >> ty >> tz >> sx >> sy >> sz >> rx >> ry >> rz;
+
+			Mesh *m = find_mesh(meshes, name);
+			if (std::isnan(rz) || sx==0.0 || sy==0.0 || sz==0.0 || !m || m==mesh)
+				throw invalid_scene_file();
+
+			/* scale, then rotate about x, y and z, then translate */
+			Transform to_world = Transform::translate(Vec3(tx, ty, tz)) *
+				Transform::rotate(2, rz) * Transform::rotate(1, ry) * Transform::rotate(0, rx) *
+				Transform::scale(Vec3(sx, sy, sz));
+			surfaces.push_back(new Instance(m, to_world));
 		}
 		else if (keyword == "v") {
 			float x, y, z; z=NAN;
 			ss >> x >> y >> z;
 			if (std::isnan(z))
 				throw invalid_scene_file();
-			Surface::vertex_array.push_back(Vec3(x, y, z));
+			if (Surface::frames.empty())
+				Surface::vertex_array.push_back(Vec3(x, y, z));
+			else
+				Surface::frames.back().push_back(Vec3(x, y, z));
+		}
+		else if (keyword == "frame") {
+			if (mesh)
+				throw invalid_scene_file();
+			Surface::frames.push_back(std::vector<Vec3>());
 		}
 		else if (keyword == "vt") {
 			float u, v; v=NAN;
@@ -222,7 +491,7 @@ Params parse_input(std::string filename, std::vector<Surface*>& surfaces, std::v
 		else if (keyword == "texture") {
 			std::string fn;
 			ss >> fn;
-			textures.push_back(new Texture(path+fn));
+			textures.push_back(cache.get(path+fn));
 			t_idx++;
 		}
 		else if (keyword == "parallel")
@@ -233,6 +502,18 @@ Params parse_input(std::string filename, std::vector<Surface*>& surfaces, std::v
 			throw invalid_scene_file();
 	}
 
+	// a mesh must be closed with endmesh
+	if (mesh)
+		throw invalid_scene_file();
+
+	if (cloud)
+		cloud->build();
+
+	// every frame moves all the vertices
+	for (std::vector<Vec3>& frame : Surface::frames)
+		if (frame.size() != Surface::vertex_array.size())
+			throw invalid_scene_file();
+
 	// check if we read all the necessary parameters
 	for (int i=0; i!=6; i++)
 		if (!gotit[i])
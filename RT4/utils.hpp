@@ -2,9 +2,12 @@
 #include <vector>
 
 #include "geometry.hpp"
+#include "instance.hpp"
 #include "lights.hpp"
+#include "options.hpp"
 #include "params.hpp"
 
-Params parse_input(std::string filename, std::vector<Surface*>& surfaces, std::vector<LightSource*>& lights, std::vector<Texture*>& textures);
+Options parse_args(int argc, char *argv[]);
+Params parse_input(std::string filename, std::vector<Surface*>& surfaces, std::vector<LightSource*>& lights, std::vector<Texture*>& textures, std::vector<Mesh*>& meshes, TextureCache& cache);
 std::string remove_ext(std::string mystr);
 std::string get_path(std::string full_path);
\ No newline at end of file
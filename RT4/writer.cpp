@@ -0,0 +1,69 @@
+#include "writer.hpp"
+
+#include <cstdio>
+#include <utility>
+
+/**
+ * @constructor
+ * Starts the thread.
+ * @param capacity The most images waiting to be written, at least 1
+ */
+ImageWriter::ImageWriter(size_t capacity) : capacity(capacity > 0? capacity: 1), busy(false), closing(false) {
+	thread = std::thread(&ImageWriter::run, this);
+}
+
+/** Writes the images still queued and stops the thread */
+ImageWriter::~ImageWriter() {
+	flush();
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closing = true;
+	}
+	changed.notify_all();
+	thread.join();
+}
+
+/**
+ * Queues an image to be saved, waiting while the queue is full
+ * @param img      The image, moved into the queue
+ * @param name     The name of the output file
+ * @param obsolete A file to remove once the image is written, such as the
+ *                 checkpoint it replaces, none if empty. It is kept if the
+ *                 image could not be written
+ */
+void ImageWriter::push(Image img, std::string name, std::string obsolete) {
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [&]() { return queue.size() < capacity; });
+	queue.push_back(Job{std::move(img), name, obsolete});
+	guard.unlock();
+	changed.notify_all();
+}
+
+/** Waits until every queued image is written */
+void ImageWriter::flush() {
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [&]() { return queue.empty() && !busy; });
+}
+
+/** The thread: saves the images in the order they were pushed */
+void ImageWriter::run() {
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		changed.wait(guard, [&]() { return !queue.empty() || closing; });
+		if (queue.empty())
+			return;
+		Job job = std::move(queue.front());
+		queue.pop_front();
+		busy = true;
+		guard.unlock();
+		changed.notify_all();
+
+		/* keep the checkpoint if the image could not be written, it can still be resumed */
+		if (job.img.save(job.name) && job.obsolete != "")
+			remove(job.obsolete.c_str());
+
+		guard.lock();
+		busy = false;
+		changed.notify_all();
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef _WRITER_HPP
+#define _WRITER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "image.hpp"
+
+/**
+ * Saves images on a thread of its own, so the next frame is rendered
+ * while the last one is formatted and written. At most capacity images
+ * wait in the queue; push blocks while it is full, which keeps the memory
+ * bounded when the disk is slower than the renderer.
+ * 	push:	queues an image, and a file to remove once it is written
+ * 	flush:	waits until every queued image is written
+ * The destructor flushes.
+ */
+class ImageWriter {
+	struct Job {
+		Image img;
+		std::string name, obsolete;
+	};
+	std::deque<Job> queue;
+	size_t capacity;
+	bool busy, closing;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::thread thread;
+	void run();
+public:
+	ImageWriter(size_t capacity);
+	~ImageWriter();
+	void push(Image img, std::string name, std::string obsolete="");
+	void flush();
+};
+
+#endif